@@ -18,3 +18,4 @@ then
 fi 
 
 ./test $DO_VERBOSE
+./crash_test $DO_VERBOSE
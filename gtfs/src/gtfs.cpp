@@ -1,10 +1,21 @@
 #include "gtfs.hpp"
 #include <stdio.h>
 #include <string.h>
+#include <climits>
 #include <algorithm>
 #include <string>
 #include <sstream>
+#include <unordered_set>
 #include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <functional>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define VERBOSE_PRINT(verbose, str...) do { \
     if (verbose) cout << "VERBOSE: "<< __FILE__ << ":" << __LINE__ << " " << __func__ << "(): " << str; \
@@ -30,73 +41,1308 @@ int find_write(file_t* fl,string id){
     return ret;
 }
 
+// Crash-point fault injection. An armed point aborts the process on its
+// (skip + 1)-th hit; flush_fp is flushed first so the partially persisted
+// state reaches the disk the way it would in a real crash.
+static int crash_point = CRASH_NONE;
+static int crash_skip = 0;
+
+static void crash_hit(int point, FILE* flush_fp = NULL){
+    if(point != crash_point) return;
+    if(crash_skip-- > 0) return;
+    if(flush_fp) fflush(flush_fp);
+    abort();
+}
+
+// Direct I/O (GTFS_DIRECT_IO). Files are opened with O_DIRECT, so every
+// transfer goes through DIO_BLOCK-aligned blocks from a bounded pool, and
+// the partial blocks at the edges of a write are read, patched and written
+// back. Nothing is left to the page cache.
+
+#define DIO_BLOCK 4096
+#define DIO_IOV 256                 // blocks per preadv/pwritev
+#define DIO_POOL_MAX 1024           // free blocks kept for reuse
+#define DIO_CACHE_MAX 1024          // dirty blocks a checkpoint holds before flushing
+
+static mutex dio_pool_lock;
+static vector<char*> dio_pool;
+
+static char* dio_alloc(){
+    {
+        lock_guard<mutex> lk(dio_pool_lock);
+        if (!dio_pool.empty()) {
+            char* block = dio_pool.back();
+            dio_pool.pop_back();
+            return block;
+        }
+    }
+    void* block;
+    return posix_memalign(&block, DIO_BLOCK, DIO_BLOCK) ? NULL : (char*)block;
+}
+
+static void dio_free(char* block){
+    lock_guard<mutex> lk(dio_pool_lock);
+    if (dio_pool.size() < DIO_POOL_MAX) dio_pool.push_back(block);
+    else free(block);
+}
+
+static off_t dio_floor(off_t off){
+    return off & ~(off_t)(DIO_BLOCK - 1);
+}
+
+static off_t dio_ceil(off_t off){
+    return dio_floor(off + DIO_BLOCK - 1);
+}
+
+// Reads one block at off, zero-filling whatever lies past the end of file.
+static int dio_read_block(int fd, char* block, off_t off){
+    ssize_t n = pread(fd, block, DIO_BLOCK, off);
+    if (n < 0) return -1;
+    memset(block + n, 0, DIO_BLOCK - n);
+    return 0;
+}
+
+static void dio_tail_reset(dio_tail_t* tail){
+    if (tail->block) dio_free(tail->block);
+    tail->block = NULL;
+}
+
+// Transfers [off, off + len) in chunks of up to DIO_IOV pool blocks. Reads
+// return the number of bytes before the end of file; writes return 0. A
+// write through tail starts from the block it remembers instead of reading
+// it, and remembers the block it leaves partly filled.
+static ssize_t dio_io(int fd, char* buf, size_t len, off_t off, int wr, dio_tail_t* tail = NULL){
+    off_t end = off + len;
+    ssize_t done = 0;
+    vector<struct iovec> iov;
+
+    for (off_t cs = dio_floor(off); cs < end; ) {
+        int nblocks = (int)std::min((off_t)DIO_IOV, (dio_ceil(end) - cs) / DIO_BLOCK);
+        off_t ce = cs + (off_t)nblocks * DIO_BLOCK;
+        off_t from = std::max(off, cs), to = std::min(end, ce);
+        ssize_t n = 0;
+        int ok = 1;
+
+        iov.resize(nblocks);
+        for (int i = 0; i < nblocks; i++) {
+            iov[i].iov_base = dio_alloc();
+            iov[i].iov_len = DIO_BLOCK;
+            if (!iov[i].iov_base) ok = 0;
+        }
+        if (ok && !wr) {
+            n = preadv(fd, iov.data(), nblocks, cs);
+            ok = n >= 0;
+            // bytes past the end of file are left untouched
+            off_t valid = std::min(to, cs + (off_t)n);
+            for (off_t at = from; ok && at < valid; ) {
+                int i = (at - cs) / DIO_BLOCK;
+                off_t bend = std::min(valid, cs + (off_t)(i + 1) * DIO_BLOCK);
+                memcpy(buf + (at - off), (char*)iov[i].iov_base + (at - cs) % DIO_BLOCK, bend - at);
+                at = bend;
+            }
+        } else if (ok) {
+            // edges only partly covered by the write keep their old bytes
+            if (from > cs && tail && tail->block && tail->off == cs) {
+                memcpy(iov[0].iov_base, tail->block, DIO_BLOCK);
+            } else if (from > cs) {
+                ok = dio_read_block(fd, (char*)iov[0].iov_base, cs) == 0;
+            }
+            if (ok && to < ce && (nblocks > 1 || from == cs)) {
+                ok = dio_read_block(fd, (char*)iov[nblocks - 1].iov_base, ce - DIO_BLOCK) == 0;
+            }
+            for (off_t at = from; ok && at < to; ) {
+                int i = (at - cs) / DIO_BLOCK;
+                off_t bend = std::min(to, cs + (off_t)(i + 1) * DIO_BLOCK);
+                memcpy((char*)iov[i].iov_base + (at - cs) % DIO_BLOCK, buf + (at - off), bend - at);
+                at = bend;
+            }
+            ok = ok && pwritev(fd, iov.data(), nblocks, cs) == (ssize_t)(ce - cs);
+            if (tail) {
+                if (ok && to < ce && (tail->block || (tail->block = dio_alloc()))) {
+                    memcpy(tail->block, iov[nblocks - 1].iov_base, DIO_BLOCK);
+                    tail->off = ce - DIO_BLOCK;
+                } else {
+                    tail->off = -1;
+                }
+            }
+        }
+        for (int i = 0; i < nblocks; i++) {
+            if (iov[i].iov_base) dio_free((char*)iov[i].iov_base);
+        }
+        if (!ok) return -1;
+        if (!wr) {
+            done += std::max((off_t)0, std::min(to, cs + (off_t)n) - from);
+            if (cs + n < ce) break;
+        }
+        cs = ce;
+    }
+    return done;
+}
+
+// Dirty data file blocks of a direct I/O checkpoint, by block offset. Writes
+// that share a block are merged in memory and each block is written once.
+typedef map<off_t, char*> dio_cache_t;
+
+static int dio_cache_flush(int fd, dio_cache_t& cache){
+    vector<struct iovec> iov;
+    int ok = 1;
+    auto it = cache.begin();
+    while (it != cache.end()) {
+        off_t start = it->first, next = start;
+        iov.clear();
+        while (it != cache.end() && it->first == next && iov.size() < DIO_IOV) {
+            iov.push_back({it->second, DIO_BLOCK});
+            next += DIO_BLOCK;
+            ++it;
+        }
+        if (ok && pwritev(fd, iov.data(), iov.size(), start) != next - start) ok = 0;
+        // with direct I/O the data file changes only here, a run at a time
+        if (ok) crash_hit(CRASH_MID_APPLY);
+    }
+    for (const auto& block: cache) dio_free(block.second);
+    cache.clear();
+    return ok ? 0 : -1;
+}
+
+static int dio_cache_write(int fd, dio_cache_t& cache, off_t off, const char* data, size_t len){
+    for (off_t at = off; at < off + (off_t)len; ) {
+        off_t block_off = dio_floor(at);
+        off_t bend = std::min(off + (off_t)len, block_off + DIO_BLOCK);
+        auto it = cache.find(block_off);
+        if (it == cache.end()) {
+            char* block = dio_alloc();
+            if (!block) return -1;
+            // a block the write does not cover entirely starts from disk
+            if ((at > block_off || bend < block_off + DIO_BLOCK) && dio_read_block(fd, block, block_off) < 0) {
+                dio_free(block);
+                return -1;
+            }
+            it = cache.insert({block_off, block}).first;
+        }
+        memcpy(it->second + (at - block_off), data + (at - off), bend - at);
+        at = bend;
+    }
+    if (cache.size() >= DIO_CACHE_MAX) return dio_cache_flush(fd, cache);
+    return 0;
+}
+
+int trct_mem_log(file_t* file);
+
+// Log records. The .log and the segment files are sequences of records, a
+// fixed header followed by the payload. Records are addressed by log
+// position (lsn), which a record repeats in its header: in a circular log
+// that tells the records of the current lap from stale ones of earlier laps.
+
+#define LOG_REC_MAGIC 0x31475452   // "RTG1"
+#define LOG_ID_LEN 32
+#define LOG_REC_DELTA 0x1          // payload is a sequence of delta runs
+
+typedef struct log_rec_hdr {
+    uint32_t magic;
+    uint32_t hdr_crc;       // of the header with hdr_crc = 0
+    uint32_t data_crc;      // of the payload
+    int32_t offset;
+    int32_t length;
+    uint32_t flags;         // LOG_REC_*
+    uint64_t lsn;
+    char id[LOG_ID_LEN];
+} log_rec_hdr_t;
+
+typedef struct log_rec {
+    string id;
+    int offset;
+    int length;
+    uint64_t lsn;           // position of the record
+    uint64_t pos;           // position of the payload
+    uint32_t data_crc;
+    uint32_t flags;
+    vector<char> runs;      // payload of a LOG_REC_DELTA record
+} log_rec_t;
+
+// A log as the record layer sees it: segment files are linear, the .log is
+// a ring of cap bytes behind its header block.
+typedef struct log_view {
+    int fd;
+    uint64_t cap;           // 0 for a linear file
+    int direct;             // fd was opened with O_DIRECT
+    dio_tail_t* tail;       // block left partly filled by the last append
+} log_view_t;
+
+#define LOG_HDR_SIZE 4096
+#define LOG_DEFAULT_SIZE (1024 * 1024)
+#define LOG_MAGIC "GTFSLOG1"
+
+typedef struct log_hdr {
+    char magic[8];
+    uint64_t cap;
+    uint64_t start;
+    uint32_t crc;
+} log_hdr_t;
+
+static uint32_t crc32(uint32_t crc, const char* buf, size_t len){
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ (unsigned char)buf[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int io_full(int fd, char* buf, size_t len, off_t off, int wr, int direct = 0, dio_tail_t* tail = NULL){
+    if (direct) {
+        ssize_t n = dio_io(fd, buf, len, off, wr, tail);
+        return (n < 0 || (!wr && n != (ssize_t)len)) ? -1 : 0;
+    }
+    while (len > 0) {
+        ssize_t n = wr ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// Reads or writes len bytes at log position lsn, wrapping around the ring.
+static int view_io(log_view_t v, uint64_t lsn, char* buf, size_t len, int wr){
+    if (!v.cap) return io_full(v.fd, buf, len, lsn, wr, v.direct, v.tail);
+    uint64_t at = lsn % v.cap;
+    size_t first = std::min((uint64_t)len, v.cap - at);
+    if (io_full(v.fd, buf, first, LOG_HDR_SIZE + at, wr, v.direct, v.tail) < 0) return -1;
+    return io_full(v.fd, buf + first, len - first, LOG_HDR_SIZE, wr, v.direct, v.tail);
+}
+
+static uint64_t record_size(int length){
+    return sizeof(log_rec_hdr_t) + length;
+}
+
+// Writes the record of write_id at lsn. Only the first `bytes` bytes of the
+// payload are written when bytes < length, which leaves a torn record that
+// recovery discards and the next append overwrites.
+static int write_record(log_view_t v, uint64_t lsn, write_t* write_id, int bytes, uint32_t flags = 0){
+    vector<char> buf(record_size(write_id->length));
+    log_rec_hdr_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = LOG_REC_MAGIC;
+    hdr.data_crc = crc32(0, write_id->data, write_id->length);
+    hdr.offset = write_id->offset;
+    hdr.length = write_id->length;
+    hdr.flags = flags;
+    hdr.lsn = lsn;
+    strncpy(hdr.id, write_id->id.c_str(), LOG_ID_LEN - 1);
+    hdr.hdr_crc = crc32(0, (char*)&hdr, sizeof(hdr));
+    memcpy(buf.data(), &hdr, sizeof(hdr));
+    memcpy(buf.data() + sizeof(hdr), write_id->data, write_id->length);
+
+    size_t len = sizeof(hdr) + bytes;
+    // written in two halves only when a test crashes between them
+    size_t half = crash_point == CRASH_MID_LOG_APPEND ? len / 2 : len;
+    if (view_io(v, lsn, buf.data(), half, 1) < 0) return -1;
+    crash_hit(CRASH_MID_LOG_APPEND);
+    if (half < len && view_io(v, lsn + half, buf.data() + half, len - half, 1) < 0) return -1;
+    crash_hit(CRASH_AFTER_LOG_APPEND);
+    return 0;
+}
+
+// Reads a log front to back for scan_records. Headers and small payloads
+// come out of one buffered chunk of the records ahead, read from a block
+// boundary, instead of a read (a whole block, with direct I/O) each. The
+// chunk doubles while every refill starts where the last one ended, that
+// is while the records are small; a refill that skips a payload reads just
+// the blocks it needs, so large records cost a header block each and the
+// end of the log is overshot by no more than was just read.
+
+#define SCAN_MAX_CHUNK (256 * 1024)
+
+typedef struct log_reader {
+    log_view_t v;
+    uint64_t limit;         // records end by this position
+    uint64_t base;          // log position of buf
+    vector<char> buf;
+} log_reader_t;
+
+static int reader_read(log_reader_t& r, uint64_t lsn, char* out, size_t len){
+    if (lsn < r.base || lsn + len > r.base + r.buf.size()) {
+        uint64_t start = dio_floor(lsn);
+        uint64_t need = dio_ceil(lsn + len) - start;
+        if (need > SCAN_MAX_CHUNK) return view_io(r.v, lsn, out, len, 0);
+        uint64_t size = DIO_BLOCK;
+        if (!r.buf.empty() && lsn >= r.base && start <= r.base + r.buf.size()) {
+            size = std::min(2 * (uint64_t)r.buf.size(), (uint64_t)SCAN_MAX_CHUNK);
+        }
+        size = std::min(std::max(size, need), r.limit - start);
+        if (r.v.cap) size = std::min(size, r.v.cap);
+        if (lsn + len > start + size) return view_io(r.v, lsn, out, len, 0);
+        r.buf.resize(size);
+        if (view_io(r.v, start, r.buf.data(), size, 0) < 0) {
+            r.buf.clear();
+            return -1;
+        }
+        r.base = start;
+    }
+    memcpy(out, r.buf.data() + (lsn - r.base), len);
+    return 0;
+}
+
+// Reads the header of the record at lsn, which must end by r.limit.
+static int read_record(log_reader_t& r, uint64_t lsn, log_rec_t& rec){
+    log_rec_hdr_t hdr;
+    uint64_t limit = r.limit;
+    if (lsn + sizeof(hdr) > limit || reader_read(r, lsn, (char*)&hdr, sizeof(hdr)) < 0) return -1;
+    uint32_t crc = hdr.hdr_crc;
+    hdr.hdr_crc = 0;
+    if (hdr.magic != LOG_REC_MAGIC || crc32(0, (char*)&hdr, sizeof(hdr)) != crc || hdr.lsn != lsn ||
+        hdr.length < 0 || hdr.offset < 0 || lsn + record_size(hdr.length) > limit) {
+        return -1;
+    }
+    hdr.id[LOG_ID_LEN - 1] = '\0';
+    rec.id = hdr.id;
+    rec.offset = hdr.offset;
+    rec.length = hdr.length;
+    rec.lsn = lsn;
+    rec.pos = lsn + sizeof(hdr);
+    rec.data_crc = hdr.data_crc;
+    rec.flags = hdr.flags;
+    return 0;
+}
+
+static int check_payload(log_reader_t& r, const log_rec_t& rec){
+    vector<char> buf(rec.length);
+    if (reader_read(r, rec.pos, buf.data(), rec.length) < 0) return -1;
+    return crc32(0, buf.data(), rec.length) == rec.data_crc ? 0 : -1;
+}
+
+// Delta records (LOG_REC_DELTA) carry runs of a write instead of its whole
+// payload: an int32 offset relative to the write, an int32 length and the
+// bytes. Calls fn(offset, length, position of the bytes) on every run of the
+// payload buf, which starts at log position pos.
+#define DELTA_RUN_HDR (2 * sizeof(int32_t))
+
+static int parse_runs(const char* buf, int len, uint64_t pos, function<int(int, int, uint64_t)> fn){
+    for (int at = 0; at < len; ) {
+        int32_t run[2];
+        if (at + (int)DELTA_RUN_HDR > len) return -1;
+        memcpy(run, buf + at, DELTA_RUN_HDR);
+        at += DELTA_RUN_HDR;
+        if (run[0] < 0 || run[1] < 0 || run[1] > len - at) return -1;
+        if (fn(run[0], run[1], pos + at) < 0) return -1;
+        at += run[1];
+    }
+    return 0;
+}
+
+// Calls fn on every run of a delta record found by scan_records.
+static int record_runs(const log_rec_t& rec, function<int(int, int, uint64_t)> fn){
+    if (parse_runs(rec.runs.data(), rec.runs.size(), rec.pos, fn) < 0) {
+        VERBOSE_PRINT(do_verbose, "Bad delta record " << rec.id << "\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Calls fn on every record from lsn up to limit and returns the position
+// after the last one. Payloads are not read, except the runs of delta
+// records and, to verify its checksum, the final record: a crash can only
+// tear the record appended last.
+static uint64_t scan_records(log_view_t v, uint64_t lsn, uint64_t limit, function<int(log_rec_t&)> fn){
+    log_reader_t r = {v, limit, 0, {}};
+    log_rec_t cur, next;
+    if (read_record(r, lsn, cur) < 0) return lsn;
+    while (true) {
+        uint64_t end = cur.lsn + record_size(cur.length);
+        int more = read_record(r, end, next) == 0;
+        if (!more && check_payload(r, cur) < 0) {
+            VERBOSE_PRINT(do_verbose, "Discarding torn log record " << cur.id << "\n");
+            return cur.lsn;
+        }
+        if (cur.flags & LOG_REC_DELTA) {
+            cur.runs.resize(cur.length);
+            if (reader_read(r, cur.pos, cur.runs.data(), cur.length) < 0) return cur.lsn;
+        }
+        if (fn(cur) < 0) return cur.lsn;
+        if (!more) return end;
+        cur = std::move(next);
+    }
+}
+
+// Circular log (<filename>.log). The ring is preallocated once and reused:
+// appends overwrite space released by earlier checkpoints and truncation
+// only moves log_start in the header, so the commit path never changes the
+// size or the block allocation of the file.
+
+static log_view_t log_view(file_t* fl){
+    log_view_t v = {fl->log_fd, fl->log_cap, fl->flags & GTFS_DIRECT_IO, &fl->log_tail};
+    return v;
+}
+
+static int log_write_hdr(file_t* fl){
+    char block[LOG_HDR_SIZE];
+    log_hdr_t hdr;
+    memset(block, 0, sizeof(block));
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LOG_MAGIC, sizeof(hdr.magic));
+    hdr.cap = fl->log_cap;
+    hdr.start = fl->log_start;
+    hdr.crc = crc32(0, (char*)&hdr, sizeof(hdr));
+    memcpy(block, &hdr, sizeof(hdr));
+    if (io_full(fl->log_fd, block, sizeof(block), 0, 1, fl->flags & GTFS_DIRECT_IO) < 0 || fdatasync(fl->log_fd)) {
+        VERBOSE_PRINT(do_verbose, "Log header write failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int log_allocate(file_t* fl, uint64_t cap){
+    // whole blocks, so direct I/O never splits one at the end of the ring
+    cap = dio_ceil(cap);
+    int err = fallocate(fl->log_fd, 0, 0, LOG_HDR_SIZE + cap);
+    if (err && (errno == EOPNOTSUPP || errno == ENOSYS)) err = posix_fallocate(fl->log_fd, 0, LOG_HDR_SIZE + cap);
+    if (err) {
+        VERBOSE_PRINT(do_verbose, "Log preallocation failed\n");
+        return -1;
+    }
+    fl->log_cap = cap;
+    return 0;
+}
+
+// Opens the log of fl, creating a ring of cap bytes if there is none. The
+// end of the log is found by trct_disk_log.
+static int log_open(file_t* fl, uint64_t cap){
+    struct stat st;
+    log_hdr_t hdr;
+
+    fl->log_fd = open((fl->filename + ".log").c_str(), O_RDWR | O_CREAT | ((fl->flags & GTFS_DIRECT_IO) ? O_DIRECT : 0), 0644);
+    if (fl->log_fd < 0 || fstat(fl->log_fd, &st) < 0) {
+        VERBOSE_PRINT(do_verbose, "Log open failed\n");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        fl->log_start = fl->log_end = 0;
+        if (log_allocate(fl, cap) < 0) return -1;
+        return log_write_hdr(fl);
+    }
+    if (io_full(fl->log_fd, (char*)&hdr, sizeof(hdr), 0, 0, fl->flags & GTFS_DIRECT_IO) < 0) {
+        VERBOSE_PRINT(do_verbose, "Log header read failed\n");
+        return -1;
+    }
+    uint32_t crc = hdr.crc;
+    hdr.crc = 0;
+    if (memcmp(hdr.magic, LOG_MAGIC, sizeof(hdr.magic)) != 0 || crc32(0, (char*)&hdr, sizeof(hdr)) != crc ||
+        (uint64_t)st.st_size < LOG_HDR_SIZE + hdr.cap) {
+        VERBOSE_PRINT(do_verbose, "Unrecognized log format\n");
+        return -1;
+    }
+    fl->log_cap = hdr.cap;
+    fl->log_start = fl->log_end = hdr.start;
+    return 0;
+}
+
+// Appends the record of write_id, checkpointing first when the ring is
+// full and growing it when the record would not fit even in an empty ring.
+static int log_append(file_t* fl, write_t* write_id, int bytes, uint32_t rec_flags = 0){
+    uint64_t need = record_size(write_id->length);
+    if (fl->log_end + need - fl->log_start > fl->log_cap) {
+        VERBOSE_PRINT(do_verbose, "Log full, checkpointing " << fl->filename << "\n");
+        if (trct_mem_log(fl) < 0) return -1;
+    }
+    if (need > fl->log_cap) {
+        if (log_allocate(fl, std::max(2 * fl->log_cap, need)) < 0 || log_write_hdr(fl) < 0) return -1;
+    }
+    if (write_record(log_view(fl), fl->log_end, write_id, bytes, rec_flags) < 0 || fdatasync(fl->log_fd)) return -1;
+    write_id->log_pos = fl->log_end + sizeof(log_rec_hdr_t);
+    if (bytes == write_id->length) fl->log_end += need;
+    return bytes;
+}
+
+static int log_truncate(file_t* fl){
+    fl->log_start = fl->log_end;
+    return log_write_hdr(fl);
+}
+
+// Indexes every record of the log that is not already in memory.
+// Payloads stay in the log and are read back on demand.
 int trct_disk_log(file_t* file){
-    int ret = -1;
-    int out = 1;
-    char line[256];
+    // ids already in memory; records of this process are skipped
+    unordered_set<string> loaded;
+    for (const auto& write: file->writes) loaded.insert(write->id);
 
-    while (out) {
+    if (file->log_fd < 0) return 0;
+    uint64_t limit = file->log_start + file->log_cap;
+    // records a lazy open indexed are read through fl->index instead
+    uint64_t from = std::max(file->log_start, file->replay_end);
+    // a delta record becomes one write per run
+    auto add = [&](const string& id, int offset, int length, uint64_t pos){
         write_t *write_id = new (std::nothrow) write_t();
-        for (int i = 0; i < 5; ++i) {
-            if (fgets(line, sizeof(line), file->log) != nullptr) {
-                string strl = line;
-                size_t colonPos = strl.find(':');
-                if(i==0 ){
-                    write_id->id = strl.substr(colonPos+1);
-                    if(!find_write(file,write_id->id)) continue;
-                }
-                else if(i==1){
-                    write_id->filename = strl.substr(colonPos+1);
-                }
-                else if(i==2){
-                    write_id->offset = stoi(strl.substr(colonPos+1));
-                }
-                else if(i==3){
-                    write_id->length = stoi(strl.substr(colonPos+1));
-                }
-                else{
-                    write_id->data = new char[write_id->length];
-                    memcpy(write_id->data, strl.substr(colonPos+1).c_str(), write_id->length);
-                }
-            } else {
-                out = 0;
-                break;
+        if (!write_id) {
+            VERBOSE_PRINT(do_verbose, "Malloc Failed\n");
+            return -1;
+        }
+        write_id->id = id;
+        write_id->filename = file->filename;
+        write_id->offset = offset;
+        write_id->length = length;
+        write_id->data = NULL;
+        write_id->log_pos = pos;
+        write_id->filep = file;
+        write_id->com = 1;
+        file->writes.push_back(write_id);
+        return 0;
+    };
+    file->log_end = scan_records(log_view(file), from, limit, [&](log_rec_t& rec){
+        if (!loaded.insert(rec.id).second) return 0;
+        if (!(rec.flags & LOG_REC_DELTA)) return add(rec.id, rec.offset, rec.length, rec.pos);
+        return record_runs(rec, [&](int offset, int length, uint64_t pos){
+            return add(rec.id, rec.offset + offset, length, pos);
+        });
+    });
+    return 0;
+}
+
+// Reads length bytes of the payload of write_id, starting skip bytes in,
+// from wherever it currently lives.
+static int load_payload(write_t* write_id, int skip, int length, char* buf){
+    if (write_id->data) {
+        memcpy(buf, write_id->data + skip, length);
+        return 0;
+    }
+    if (view_io(log_view(write_id->filep), write_id->log_pos + skip, buf, length, 0) < 0) {
+        VERBOSE_PRINT(do_verbose, "Log read failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void mem_release(gtfs_t* gtfs, long bytes){
+    if (!gtfs || !bytes) return;
+    lock_guard<mutex> lk(gtfs->mem_lock);
+    gtfs->mem_used -= bytes;
+}
+
+// Frees the payload of a committed write that can be read back later.
+static void spill_write(write_t* write_id){
+    if (!write_id->data) return;
+    delete[] write_id->data;
+    write_id->data = NULL;
+    mem_release((write_id->filep)->gtfs, write_id->length);
+}
+
+// Sequential readahead. Once a file is read sequentially, data file reads
+// are served from fl->ra_buf, refilled with one large pread per window, and
+// the kernel is told to start fetching the window after it. The window
+// doubles on every refill. Pending writes are overlaid by the caller, so
+// they always win over prefetched bytes.
+
+#define RA_TRIGGER 2                // sequential reads before readahead starts
+#define RA_MIN_WINDOW (64 * 1024)
+#define RA_MAX_WINDOW (4 * 1024 * 1024)
+
+static void ra_invalidate(file_t* fl){
+    fl->ra_len = 0;
+}
+
+// pread on the data file, through the aligned pool in direct I/O mode.
+static ssize_t data_pread(file_t* fl, char* buf, size_t len, off_t off){
+    if (fl->flags & GTFS_DIRECT_IO) return dio_io(fl->dfd, buf, len, off, 0);
+    return pread(fileno(fl->fp), buf, len, off);
+}
+
+// Reads [offset, offset + length) of the data file into buf. Bytes past the
+// end of the file are left untouched.
+static int read_base(file_t* fl, int offset, int length, char* buf){
+
+    if (offset == fl->ra_next) {
+        fl->ra_seq++;
+    } else {
+        fl->ra_seq = 0;
+        fl->ra_window = RA_MIN_WINDOW;
+        ra_invalidate(fl);
+    }
+    fl->ra_next = (long)offset + length;
+    if (fl->ra_seq < RA_TRIGGER) {
+        ssize_t n = data_pread(fl, buf, length, offset);
+        return n < 0 ? -1 : 0;
+    }
+
+    if (offset < fl->ra_off || (long)offset + length > fl->ra_off + fl->ra_len) {
+        int window = std::max(fl->ra_window, RA_MIN_WINDOW);
+        // a read as large as the window goes straight to the caller, which
+        // keeps ra_buf within RA_MAX_WINDOW
+        if (length >= window) {
+            ssize_t n = data_pread(fl, buf, length, offset);
+            if (n < 0) return -1;
+            if (n == length && !(fl->flags & GTFS_DIRECT_IO)) {
+                posix_fadvise(fileno(fl->fp), (off_t)offset + length, std::min(window * 2, RA_MAX_WINDOW), POSIX_FADV_WILLNEED);
             }
+            fl->ra_window = std::min(window * 2, RA_MAX_WINDOW);
+            return 0;
+        }
+        fl->ra_buf.resize(window);
+        ssize_t n = data_pread(fl, fl->ra_buf.data(), window, offset);
+        if (n < 0) {
+            ra_invalidate(fl);
+            return -1;
         }
-        if(out){
-            write_id->filep = file;
-            write_id->com = 1;
-            file->writes.push_back(write_id);
+        fl->ra_off = offset;
+        fl->ra_len = (int)n;
+        // direct I/O bypasses the page cache, so there is nothing to prefetch into
+        if (n == window && !(fl->flags & GTFS_DIRECT_IO)) {
+            posix_fadvise(fileno(fl->fp), (off_t)offset + window, std::min(window * 2, RA_MAX_WINDOW), POSIX_FADV_WILLNEED);
         }
+        fl->ra_window = std::min(window * 2, RA_MAX_WINDOW);
+        VERBOSE_PRINT(do_verbose, "Readahead of " << n << " bytes at offset " << offset << " inside file " << fl->filename << "\n");
     }
-    ret = 0;
-    return ret;
+    long avail = fl->ra_off + fl->ra_len - offset;
+    if (avail > 0) memcpy(buf, fl->ra_buf.data() + (offset - fl->ra_off), std::min((long)length, avail));
+    return 0;
+}
+
+// Frees every write of fl and returns its payload memory to the budget.
+static void free_writes(file_t* fl){
+    for (const auto& write: fl->writes){
+        if (write->data) mem_release(fl->gtfs, write->length);
+        delete[] write->data;
+        delete write;
+    }
+    fl->writes.clear();
+}
+
+// Frees the committed writes of file, keeping the uncommitted ones.
+static void drop_committed(file_t* file){
+    vector<write_t*> pending;
+    for (const auto& write: file->writes){
+        if (!write->com) {
+            pending.push_back(write);
+            continue;
+        }
+        spill_write(write);
+        delete write;
+    }
+    file->writes = pending;
 }
 
+static int replay_finish(file_t* fl);
 
+// Checkpoints committed writes into the data file and truncates the log.
+// Uncommitted writes stay in memory.
 int trct_mem_log(file_t* file){
     int ret = -1;
+    // log-structured files already hold committed data in their segments
+    if (file->flags & GTFS_LOG_STRUCTURED) {
+        drop_committed(file);
+        return 0;
+    }
+    // records indexed by a lazy open reach the data file first
+    int replayed = replay_finish(file);
+    if (replayed < 0) return ret;
+    int committed = 0;
+    for (const auto& write: file->writes) committed += write->com;
+    // nothing to checkpoint, and the log holds no records; a synced write
+    // that was aborted leaves its record behind, so look at the ring itself
+    if (!committed && !replayed && file->log_start == file->log_end) return 0;
+    vector<char> buf;
+    dio_cache_t cache;
+    struct stat st;
+    off_t size = 0;
+    if ((file->flags & GTFS_DIRECT_IO) && fstat(file->dfd, &st) == 0) size = st.st_size;
     for (const auto& write: file->writes){
-        if (fseek((write->filep)->fp, write->offset, SEEK_SET) != 0) {
+        if (!write->com) continue;
+        char* data = write->data;
+        if (!data) {
+            buf.resize(write->length);
+            data = buf.data();
+            if (load_payload(write, 0, write->length, data) < 0) return ret;
+        }
+        if (file->flags & GTFS_DIRECT_IO) {
+            if (dio_cache_write(file->dfd, cache, write->offset, data, write->length) < 0) {
+                VERBOSE_PRINT(do_verbose, "Write failed\n");
+                dio_cache_flush(file->dfd, cache);
+                return ret;
+            }
+            size = std::max(size, (off_t)write->offset + write->length);
+            continue;
+        }
+        if (fseek(file->fp, write->offset, SEEK_SET) != 0) {
             VERBOSE_PRINT(do_verbose, "Seek(moving to offset) failed\n");
             return ret;
         }
-        size_t data_len = fwrite(write->data,sizeof(char),write->length,(write->filep)->fp);
-        if(data_len != write->length){
+        size_t data_len = fwrite(data,sizeof(char),write->length,file->fp);
+        if(data_len != (size_t)write->length){
             VERBOSE_PRINT(do_verbose, "Write failed\n");
             return ret;
         }
-        delete write->data;
-        delete write;
+        crash_hit(CRASH_MID_APPLY, file->fp);
     }
-    file->writes.clear();
-    fclose(file->log);
-    file->log = fopen((file->filename + ".log").c_str(),"w+");
+    // whole blocks overshoot the end of the file; cut it back to the last write
+    if ((file->flags & GTFS_DIRECT_IO) &&
+        (dio_cache_flush(file->dfd, cache) < 0 || ftruncate(file->dfd, size) < 0)) {
+        VERBOSE_PRINT(do_verbose, "Write failed\n");
+        return ret;
+    }
+    // the data file must be on disk before the log that covers it goes away
+    if (fflush(file->fp) || fdatasync(fileno(file->fp))) {
+        VERBOSE_PRINT(do_verbose, "Flush failed\n");
+        return ret;
+    }
+    ra_invalidate(file);
+    crash_hit(CRASH_BEFORE_LOG_TRUNCATE);
+    drop_committed(file);
+    file->index.clear();
+    if (log_truncate(file) < 0) return ret;
+    return 0;
+}
+
+
+// Log-structured mode (GTFS_LOG_STRUCTURED). Committed writes are appended
+// to segment files <filename>.seg.<seq> and located through fl->index; the
+// data file is only a read-only base. A background compactor rewrites the
+// live extents into a fresh segment and removes the old ones once dead data
+// dominates. Replaying the segments in sequence order rebuilds the index.
+
+#define SEG_COMPACT_MIN (256 * 1024)   // never compact below this many segment bytes
+#define SEG_COMPACT_RATIO 4            // compact once segments hold this many times the live data
+#define SEG_MAX_COUNT 8                // or once a file has more segments than this
+#define LOG_SEG -1                     // extent in the .log, indexed by a lazy open
+
+static string seg_name(file_t* fl, int seq){
+    return fl->filename + ".seg." + to_string(seq);
+}
+
+static log_view_t seg_view(file_t* fl, int fd, dio_tail_t* tail = NULL){
+    log_view_t v = {fd, 0, fl->flags & GTFS_DIRECT_IO, tail};
+    return v;
+}
+
+static int seg_open_flags(file_t* fl){
+    return (fl->flags & GTFS_DIRECT_IO) ? O_DIRECT : 0;
+}
+
+static string seg_dir(const string& filename){
+    size_t slash = filename.rfind('/');
+    return slash == string::npos ? "." : filename.substr(0, slash + 1);
+}
+
+// Makes the creation or removal of segment files of fl durable.
+static int sync_dir(file_t* fl){
+    int fd = open(seg_dir(fl->filename).c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd)) {
+        VERBOSE_PRINT(do_verbose, "Directory sync failed\n");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Sequence numbers of the segments of filename found on disk, in order.
+static vector<int> list_segs(const string& filename){
+    vector<int> seqs;
+    size_t slash = filename.rfind('/');
+    string dir = seg_dir(filename);
+    string prefix = (slash == string::npos ? filename : filename.substr(slash + 1)) + ".seg.";
+    DIR* d = opendir(dir.c_str());
+    if (!d) return seqs;
+    while (struct dirent* ent = readdir(d)) {
+        string name = ent->d_name;
+        char* end;
+        if (name.compare(0, prefix.length(), prefix) != 0 || name.length() == prefix.length()) continue;
+        long seq = strtol(name.c_str() + prefix.length(), &end, 10);
+        if (*end == '\0' && seq >= 0) seqs.push_back((int)seq);
+    }
+    closedir(d);
+    sort(seqs.begin(), seqs.end());
+    return seqs;
+}
+
+// Every open starts a new segment, so small files that are reopened often
+// pile up segments (and descriptors) long before they reach SEG_COMPACT_MIN.
+static int needs_compaction(file_t* fl){
+    return (fl->seg_bytes > SEG_COMPACT_MIN && fl->seg_bytes > SEG_COMPACT_RATIO * fl->live_bytes) ||
+           fl->segs.size() > SEG_MAX_COUNT;
+}
+
+// Points [offset, offset + length) at the given segment location, trimming
+// or splitting the extents it overwrites.
+static void index_insert(file_t* fl, int offset, int length, int seg, long pos){
+    int end = offset + length;
+    auto it = fl->index.lower_bound(offset);
+    if (it != fl->index.begin()) {
+        auto prev = std::prev(it);
+        int pstart = prev->first;
+        int pend = pstart + prev->second.length;
+        if (pend > offset) {
+            if (pend > end) {
+                extent_t tail = prev->second;
+                tail.length = pend - end;
+                tail.pos += end - pstart;
+                fl->index[end] = tail;
+            }
+            prev->second.length = offset - pstart;
+            fl->live_bytes -= std::min(pend, end) - offset;
+        }
+    }
+    it = fl->index.lower_bound(offset);
+    while (it != fl->index.end() && it->first < end) {
+        int estart = it->first;
+        extent_t ext = it->second;
+        it = fl->index.erase(it);
+        if (estart + ext.length > end) {
+            ext.pos += end - estart;
+            ext.length -= end - estart;
+            fl->index[end] = ext;
+            fl->live_bytes -= end - estart;
+            break;
+        }
+        fl->live_bytes -= ext.length;
+    }
+    fl->index[offset] = {length, seg, pos};
+    fl->live_bytes += length;
+}
+
+// Overlays the extents of index that intersect [offset, offset + length)
+// on buf, reading them through the segment descriptors segs.
+static int extents_read(file_t* fl, const map<int, extent_t>& index, map<int, int>& segs,
+                        int offset, int length, char* buf){
+    int end = offset + length;
+    auto it = index.upper_bound(offset);
+    if (it != index.begin()) --it;
+    for (; it != index.end() && it->first < end; ++it) {
+        int estart = it->first;
+        int eend = estart + it->second.length;
+        if (eend <= offset) continue;
+        int start = std::max(offset, estart);
+        int stop = std::min(end, eend);
+        log_view_t seg = it->second.seg == LOG_SEG ? log_view(fl) : seg_view(fl, segs[it->second.seg]);
+        if (view_io(seg, it->second.pos + (start - estart), buf + (start - offset), stop - start, 0) < 0) {
+            VERBOSE_PRINT(do_verbose, "Segment read failed\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Overlays the committed extents that intersect [offset, offset + length) on buf.
+static int index_read(file_t* fl, int offset, int length, char* buf){
+    return extents_read(fl, fl->index, fl->segs, offset, length, buf);
+}
+
+static int open_active_seg(file_t* fl){
+    int seq = fl->next_seg++;
+    int fd = open(seg_name(fl, seq).c_str(), O_RDWR | O_CREAT | O_TRUNC | seg_open_flags(fl), 0644);
+    if (fd < 0) {
+        VERBOSE_PRINT(do_verbose, "Segment create failed\n");
+        return -1;
+    }
+    // commits into the segment are only durable once its name is
+    if (sync_dir(fl) < 0) {
+        close(fd);
+        remove(seg_name(fl, seq).c_str());
+        return -1;
+    }
+    fl->segs[seq] = fd;
+    fl->active_seg = seq;
+    fl->seg_end = 0;
+    fl->seg_tail.off = -1;
+    return 0;
+}
+
+// Rebuilds the index from the segments on disk and starts a fresh active
+// segment, so nothing is ever appended behind a torn tail.
+static int seg_recover(file_t* fl){
+    struct stat st;
+    for (int seq: list_segs(fl->filename)) {
+        int fd = open(seg_name(fl, seq).c_str(), O_RDONLY | seg_open_flags(fl));
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            VERBOSE_PRINT(do_verbose, "Segment open failed\n");
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        fl->segs[seq] = fd;
+        fl->next_seg = seq + 1;
+        log_view_t seg = seg_view(fl, fd);
+        scan_records(seg, 0, st.st_size, [&](log_rec_t& rec){
+            fl->seg_bytes += rec.length;
+            if (!(rec.flags & LOG_REC_DELTA)) {
+                index_insert(fl, rec.offset, rec.length, seq, rec.pos);
+                return 0;
+            }
+            return record_runs(rec, [&](int offset, int length, uint64_t pos){
+                index_insert(fl, rec.offset + offset, length, seq, pos);
+                return 0;
+            });
+        });
+    }
+    return open_active_seg(fl);
+}
+
+// Copies the live extents into a new segment, coalescing adjacent ones,
+// then drops the older segments. Appends move on to a fresh active segment
+// numbered after the compacted one, so the copy runs from a snapshot of the
+// index without fl->lock, and replaying the segments in sequence order gives
+// the current state at every step. The lock is only held to start and to
+// swap the compacted segment in.
+static int compact_segs(file_t* fl){
+    map<int, extent_t> snap, index;
+    map<int, int> old_segs;
+    long snap_bytes, bytes = 0;
+    uint64_t lsn = 0;
+    int seq, out;
+    {
+        lock_guard<mutex> lk(fl->lock);
+        if (fl->compacting) return 0;
+        seq = fl->next_seg++;
+        out = open(seg_name(fl, seq).c_str(), O_RDWR | O_CREAT | O_TRUNC | seg_open_flags(fl), 0644);
+        if (out < 0 || open_active_seg(fl) < 0) {
+            VERBOSE_PRINT(do_verbose, "Segment create failed\n");
+            if (out >= 0) {
+                close(out);
+                remove(seg_name(fl, seq).c_str());
+            }
+            return -1;
+        }
+        fl->compacting = 1;
+        snap = fl->index;
+        old_segs = fl->segs;
+        old_segs.erase(fl->active_seg);
+        snap_bytes = fl->seg_bytes;
+    }
+    dio_tail_t tail = {-1, NULL};
+    log_view_t view = seg_view(fl, out, &tail);
+    int ok = 1;
+
+    VERBOSE_PRINT(do_verbose, "Compacting " << snap_bytes << " segment bytes of " << fl->filename << "\n");
+    auto it = snap.begin();
+    while (ok && it != snap.end()) {
+        int start = it->first;
+        int end = start + it->second.length;
+        auto run = std::next(it);
+        while (run != snap.end() && run->first == end) {
+            end += run->second.length;
+            ++run;
+        }
+        write_t rec;
+        rec.id = "compact";
+        rec.filename = fl->filename;
+        rec.offset = start;
+        rec.length = end - start;
+        rec.data = new char[rec.length];
+        ok = extents_read(fl, snap, old_segs, start, rec.length, rec.data) == 0 &&
+             write_record(view, lsn, &rec, rec.length) == 0;
+        delete[] rec.data;
+        index[start] = {rec.length, seq, (long)(lsn + sizeof(log_rec_hdr_t))};
+        lsn += record_size(rec.length);
+        bytes += rec.length;
+        it = run;
+    }
+    dio_tail_reset(&tail);
+    // the compacted segment must be durable, name included, before the old
+    // ones go away
+    if (!ok || fsync(out) || sync_dir(fl) < 0) {
+        VERBOSE_PRINT(do_verbose, "Compaction failed\n");
+        close(out);
+        remove(seg_name(fl, seq).c_str());
+        lock_guard<mutex> lk(fl->lock);
+        fl->compacting = 0;
+        return -1;
+    }
+    crash_hit(CRASH_MID_COMPACT);
+
+    lock_guard<mutex> lk(fl->lock);
+    // extents still in old segments were in the snapshot, so they lie
+    // inside one of the compacted runs
+    for (auto& ext: fl->index) {
+        if (!old_segs.count(ext.second.seg)) continue;
+        auto run = std::prev(index.upper_bound(ext.first));
+        ext.second.seg = seq;
+        ext.second.pos = run->second.pos + (ext.first - run->first);
+    }
+    for (const auto& seg: old_segs) {
+        close(seg.second);
+        remove(seg_name(fl, seg.first).c_str());
+        fl->segs.erase(seg.first);
+    }
+    sync_dir(fl);
+    fl->segs[seq] = out;
+    fl->seg_bytes = bytes + (fl->seg_bytes - snap_bytes);
+    fl->compacting = 0;
     return 0;
 }
 
+static void compactor_main(file_t* fl){
+    unique_lock<mutex> lk(fl->lock);
+    while (true) {
+        fl->wake.wait(lk, [fl]{ return fl->stop || (!fl->compacting && needs_compaction(fl)); });
+        if (fl->stop) break;
+        lk.unlock();
+        int err = compact_segs(fl) < 0;
+        lk.lock();
+        // try again after the next append rather than spin on the failure
+        if (err) {
+            VERBOSE_PRINT(do_verbose, "Background compaction of " << fl->filename << " failed\n");
+            if (!fl->stop) fl->wake.wait(lk);
+        }
+    }
+}
+
+// Compacts fl in the caller's thread if it needs it.
+static int seg_compact(file_t* fl){
+    {
+        lock_guard<mutex> lk(fl->lock);
+        if (!needs_compaction(fl)) return 0;
+    }
+    return compact_segs(fl);
+}
+
+// Appends a committed write to the active segment and indexes it.
+static int seg_append(file_t* fl, write_t* write_id, int bytes, uint32_t rec_flags = 0){
+    lock_guard<mutex> lk(fl->lock);
+    log_view_t seg = seg_view(fl, fl->segs[fl->active_seg], &fl->seg_tail);
+    if (write_record(seg, fl->seg_end, write_id, bytes, rec_flags) < 0 || fdatasync(seg.fd)) return -1;
+    // a torn record is overwritten by the next append
+    if (bytes < write_id->length) return bytes;
+    uint64_t pos = fl->seg_end + sizeof(log_rec_hdr_t);
+    if (rec_flags & LOG_REC_DELTA) {
+        parse_runs(write_id->data, write_id->length, pos, [&](int offset, int length, uint64_t at){
+            index_insert(fl, write_id->offset + offset, length, fl->active_seg, at);
+            return 0;
+        });
+    } else {
+        index_insert(fl, write_id->offset, write_id->length, fl->active_seg, pos);
+    }
+    fl->seg_end += record_size(write_id->length);
+    fl->seg_bytes += write_id->length;
+    if (needs_compaction(fl)) fl->wake.notify_one();
+    return bytes;
+}
+
+static void seg_close(file_t* fl){
+    {
+        lock_guard<mutex> lk(fl->lock);
+        fl->stop = 1;
+    }
+    fl->wake.notify_one();
+    if (fl->compactor.joinable()) fl->compactor.join();
+    // direct I/O writes whole blocks past the last record
+    if ((fl->flags & GTFS_DIRECT_IO) && fl->segs.count(fl->active_seg)) {
+        if (ftruncate(fl->segs[fl->active_seg], fl->seg_end) < 0) {
+            VERBOSE_PRINT(do_verbose, "Segment truncate failed\n");
+        }
+    }
+    struct stat st;
+    for (const auto& seg: fl->segs) {
+        int empty = fstat(seg.second, &st) == 0 && st.st_size == 0;
+        close(seg.second);
+        if (empty) remove(seg_name(fl, seg.first).c_str());
+    }
+    fl->segs.clear();
+    fl->index.clear();
+    dio_tail_reset(&fl->seg_tail);
+}
+
+// Lazy replay (GTFS_LAZY_REPLAY). Opening only reads the record headers of
+// the log and indexes the committed extents in fl->index, pointing into
+// the log; reads overlay them from there. A background thread copies them
+// into the data file, and the next checkpoint joins it, drops the index and
+// truncates the log. Until then the log is neither truncated nor grown, so
+// the indexed positions stay valid.
+
+static int log_index(file_t* fl){
+    uint64_t limit = fl->log_start + fl->log_cap;
+    fl->log_end = scan_records(log_view(fl), fl->log_start, limit, [&](log_rec_t& rec){
+        if (!(rec.flags & LOG_REC_DELTA)) {
+            index_insert(fl, rec.offset, rec.length, LOG_SEG, rec.pos);
+            return 0;
+        }
+        return record_runs(rec, [&](int offset, int length, uint64_t pos){
+            index_insert(fl, rec.offset + offset, length, LOG_SEG, pos);
+            return 0;
+        });
+    });
+    fl->replay_end = fl->log_end;
+    VERBOSE_PRINT(do_verbose, "Indexed " << fl->index.size() << " log extents of " << fl->filename << "\n");
+    return 0;
+}
+
+static void replay_main(file_t* fl){
+    int direct = fl->flags & GTFS_DIRECT_IO;
+    int fd = direct ? fl->dfd : fileno(fl->fp);
+    vector<char> buf;
+    struct stat st;
+    off_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    // in log order, so the log is read front to back in chunks; with direct
+    // I/O the data file blocks are merged and written like a checkpoint
+    vector<const pair<const int, extent_t>*> order;
+    for (const auto& ext: fl->index) order.push_back(&ext);
+    stable_sort(order.begin(), order.end(), [](const pair<const int, extent_t>* a, const pair<const int, extent_t>* b){
+        return a->second.pos < b->second.pos;
+    });
+    log_reader_t r = {log_view(fl), fl->replay_end, 0, {}};
+    dio_cache_t cache;
+    for (const auto ext: order) {
+        buf.resize(ext->second.length);
+        int ok = reader_read(r, ext->second.pos, buf.data(), buf.size()) == 0;
+        if (ok && direct) ok = dio_cache_write(fd, cache, ext->first, buf.data(), buf.size()) == 0;
+        else if (ok) ok = io_full(fd, buf.data(), buf.size(), ext->first, 1) == 0;
+        if (!ok) {
+            dio_cache_flush(fd, cache);
+            fl->replay_err = 1;
+            return;
+        }
+        size = std::max(size, (off_t)ext->first + ext->second.length);
+    }
+    // whole direct I/O blocks overshoot the end of the file
+    if ((direct && (dio_cache_flush(fd, cache) < 0 || ftruncate(fd, size) < 0)) || fdatasync(fd)) fl->replay_err = 1;
+}
+
+// Waits for the background replay. Returns 1 if there was one, so the log
+// needs truncating, and -1 if it failed.
+static int replay_finish(file_t* fl){
+    if ((fl->flags & GTFS_LOG_STRUCTURED) || fl->index.empty()) return 0;
+    if (fl->replayer.joinable()) fl->replayer.join();
+    if (fl->replay_err) {
+        VERBOSE_PRINT(do_verbose, "Log replay failed\n");
+        return -1;
+    }
+    return 1;
+}
 
-gtfs_t* gtfs_init(string directory, int verbose_flag) {
+// Delta logging (GTFS_DELTA_LOG). At sync time a payload is compared with
+// the committed contents of its range and only the runs that differ are
+// logged. In memory the write keeps its whole payload, which is why a
+// delta-logged write is never spilled: the log alone cannot rebuild it.
+
+// First index from i where a and b differ, or len.
+static int skip_equal(const char* a, const char* b, int i, int len){
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (mask != 0xffff) return i + __builtin_ctz(~mask);
+    }
+#endif
+    while (i < len && a[i] == b[i]) i++;
+    return i;
+}
+
+// Encodes the runs where data differs from cur. Runs closer together than
+// a run header are merged, since splitting them would only cost more.
+static vector<char> delta_encode(const char* data, const char* cur, int len){
+    vector<char> out;
+    int i = skip_equal(data, cur, 0, len);
+    while (i < len) {
+        int start = i, end = i;
+        while (i < len) {
+            while (i < len && data[i] != cur[i]) i++;
+            end = i;
+            i = skip_equal(data, cur, i, len);
+            if (i - end >= (int)DELTA_RUN_HDR) break;
+        }
+        int32_t run[2] = {start, end - start};
+        out.insert(out.end(), (char*)run, (char*)run + DELTA_RUN_HDR);
+        out.insert(out.end(), data + start, data + end);
+    }
+    return out;
+}
+
+// Logs write_id as a delta record when that is smaller than its full
+// record. Returns 1 if it did, 0 if the full record should be logged.
+static int delta_append(file_t* fl, write_t* write_id){
+    vector<char> cur(write_id->length, 0);
+    if (data_pread(fl, cur.data(), write_id->length, write_id->offset) < 0) return -1;
+    {
+        lock_guard<mutex> lk(fl->lock);
+        if (index_read(fl, write_id->offset, write_id->length, cur.data()) < 0) return -1;
+    }
+    if (!(fl->flags & GTFS_LOG_STRUCTURED)) {
+        // the base must be what recovery rebuilds, so committed writes are
+        // overlaid in log order rather than in the order they were created
+        vector<write_t*> committed;
+        for (const auto& write: fl->writes) {
+            if (write->com) committed.push_back(write);
+        }
+        stable_sort(committed.begin(), committed.end(), [](write_t* a, write_t* b){ return a->log_pos < b->log_pos; });
+        for (const auto& write: committed) {
+            int start = std::max(write_id->offset, write->offset);
+            int end = std::min(write_id->offset + write_id->length, write->offset + write->length);
+            if (start >= end) continue;
+            if (load_payload(write, start - write->offset, end - start, cur.data() + (start - write_id->offset)) < 0) return -1;
+        }
+    }
+    vector<char> payload = delta_encode(write_id->data, cur.data(), write_id->length);
+    if (payload.size() >= (size_t)write_id->length) return 0;
+
+    write_t rec;
+    rec.id = write_id->id;
+    rec.filename = fl->filename;
+    rec.offset = write_id->offset;
+    rec.length = payload.size();
+    rec.data = payload.data();
+    rec.filep = fl;
+    if (((fl->flags & GTFS_LOG_STRUCTURED) ?
+         seg_append(fl, &rec, rec.length, LOG_REC_DELTA) :
+         log_append(fl, &rec, rec.length, LOG_REC_DELTA)) < 0) {
+        return -1;
+    }
+    VERBOSE_PRINT(do_verbose, "Logged " << rec.length << " delta bytes for a write of " << write_id->length << " bytes\n");
+    write_id->delta = 1;
+    write_id->log_pos = rec.log_pos;
+    return 1;
+}
+
+// Pending-write memory budget. Payloads of uncommitted writes only exist in
+// memory; committed ones also live in the log (or a segment), so they can be
+// spilled or checkpointed when the budget runs out.
+
+// Spills committed payloads, oldest first, until `needed` more bytes fit.
+static void mem_spill(gtfs_t* gtfs, long needed){
+    for (const auto& file: gtfs->fsq) {
+        for (const auto& write: file->writes) {
+            {
+                lock_guard<mutex> lk(gtfs->mem_lock);
+                if (gtfs->mem_used + needed <= gtfs->mem_budget) return;
+            }
+            if (write->com && !write->delta) spill_write(write);
+        }
+    }
+}
+
+// Charges length bytes of new payload to gtfs, reclaiming committed
+// payloads when the budget is exceeded. Returns -1 if the write still does
+// not fit; nothing else could free memory while the caller waits, so the
+// refusal itself is the backpressure.
+static int mem_reserve(gtfs_t* gtfs, int length){
+    unique_lock<mutex> lk(gtfs->mem_lock);
+    if (gtfs->mem_budget && gtfs->mem_used + length > gtfs->mem_budget) {
+        int checkpoint = gtfs->mem_policy == GTFS_MEM_CHECKPOINT;
+        lk.unlock();
+        if (!checkpoint) {
+            VERBOSE_PRINT(do_verbose, "Memory budget exceeded, spilling committed writes\n");
+            mem_spill(gtfs, length);
+            // delta-logged payloads cannot be spilled, only checkpointed
+            lk.lock();
+            checkpoint = gtfs->mem_used + length > gtfs->mem_budget;
+            lk.unlock();
+        }
+        if (checkpoint) {
+            VERBOSE_PRINT(do_verbose, "Memory budget exceeded, checkpointing\n");
+            for (const auto& file: gtfs->fsq) {
+                if (trct_mem_log(file) < 0) return -1;
+            }
+        }
+        lk.lock();
+        if (gtfs->mem_used + length > gtfs->mem_budget) return -1;
+    }
+    gtfs->mem_used += length;
+    return 0;
+}
+
+gtfs_t* gtfs_init(string directory, int verbose_flag, int flags) {
     do_verbose = verbose_flag;
     gtfs_t *gtfs = NULL;
     int found = 0;
@@ -117,6 +1363,7 @@ gtfs_t* gtfs_init(string directory, int verbose_flag) {
             return NULL;
         }
         gtfs->dirname = directory;
+        gtfs->flags = flags;
         efd.push_back(gtfs);
     }
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
@@ -136,6 +1383,12 @@ int gtfs_clean(gtfs_t *gtfs) {
                 VERBOSE_PRINT(do_verbose, "Error while truncating log\n");
                 return ret;
             }
+            if(file->flags & GTFS_LOG_STRUCTURED){
+                if(seg_compact(file) < 0){
+                    VERBOSE_PRINT(do_verbose, "Error while compacting segments\n");
+                    return ret;
+                }
+            }
         }
         
     } else {
@@ -145,10 +1398,11 @@ int gtfs_clean(gtfs_t *gtfs) {
     //TODO: Add any additional initializations and checks, and complete the functionality
 
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    ret = 0;
     return ret;
 }
 
-file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length) {
+file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length, int flags) {
     file_t *fl = NULL;
     int found = 0;
     fstream file;
@@ -195,13 +1449,9 @@ file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length) {
         }
         fl->file_length = file_length;
         fl->filename = filename;
+        fl->gtfs = gtfs;
         fl->fp = fopen(filename.c_str(), "r+");
-        fl->log = fopen((filename + ".log").c_str(),"r+");
         //if file doesn't exist in disk, create new file and corresponding log file.
-        if(fl->log){
-            trct_disk_log(fl);
-            trct_mem_log(fl);
-        }
         if(!fl->fp) {
             fl->fp = fopen(filename.c_str(),"w+");
             if(!fl->fp){
@@ -209,8 +1459,54 @@ file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length) {
                 delete fl;
                 return NULL;
             }
-            //create log file
-            fl->log = fopen((filename + ".log").c_str(),"w+");
+        }
+        fl->log_fd = -1;
+        fl->dfd = -1;
+        flags |= gtfs->flags;
+        //direct I/O needs a filesystem that supports O_DIRECT; fall back to
+        //buffered I/O where it does not
+        if(flags & GTFS_DIRECT_IO){
+            fl->dfd = open(filename.c_str(), O_RDWR | O_DIRECT);
+            if(fl->dfd < 0){
+                VERBOSE_PRINT(do_verbose, "Direct I/O unavailable, using buffered I/O\n");
+                flags &= ~GTFS_DIRECT_IO;
+            }
+        }
+        fl->flags = flags & GTFS_DIRECT_IO;
+        //a file that already has segments stays log-structured
+        if(!list_segs(filename).empty()) flags |= GTFS_LOG_STRUCTURED;
+        //open or create the log and recover committed writes left in it by a
+        //crash; log-structured files only keep a log they already had. A lazy
+        //open only indexes the records and applies them in the background
+        int lazy = (flags & GTFS_LAZY_REPLAY) && !(flags & GTFS_LOG_STRUCTURED);
+        if(!(flags & GTFS_LOG_STRUCTURED) || access((filename + ".log").c_str(), F_OK) == 0){
+            int err = log_open(fl, gtfs->log_size ? gtfs->log_size : LOG_DEFAULT_SIZE) < 0;
+            if(!err && lazy) err = log_index(fl) < 0;
+            else if(!err) err = trct_disk_log(fl) < 0 || trct_mem_log(fl) < 0;
+            if(err){
+                VERBOSE_PRINT(do_verbose, "Log Recovery Failed!\n");
+                fclose(fl->fp);
+                if(fl->log_fd >= 0) close(fl->log_fd);
+                if(fl->dfd >= 0) close(fl->dfd);
+                delete fl;
+                return NULL;
+            }
+        }
+        fl->flags = flags;
+        if(fl->flags & GTFS_LOG_STRUCTURED){
+            if(seg_recover(fl) < 0){
+                VERBOSE_PRINT(do_verbose, "Segment Recovery Failed!\n");
+                seg_close(fl);
+                fclose(fl->fp);
+                if(fl->log_fd >= 0) close(fl->log_fd);
+                if(fl->dfd >= 0) close(fl->dfd);
+                delete fl;
+                return NULL;
+            }
+            fl->compactor = thread(compactor_main, fl);
+        }
+        else if(!fl->index.empty()){
+            fl->replayer = thread(replay_main, fl);
         }
         
         gtfs->fsq.push_back(fl);
@@ -248,7 +1544,17 @@ int gtfs_close_file(gtfs_t* gtfs, file_t* fl) {
             VERBOSE_PRINT(do_verbose, "Error while truncating log\n");
             return ret;
         }
-        if(fclose(fl->fp)){
+        if(fl->flags & GTFS_LOG_STRUCTURED){
+            if(seg_compact(fl) < 0){
+                VERBOSE_PRINT(do_verbose, "Error while compacting segments\n");
+                return ret;
+            }
+            seg_close(fl);
+        }
+        // writes that were never synced die with the file
+        free_writes(fl);
+        dio_tail_reset(&fl->log_tail);
+        if(fclose(fl->fp) || (fl->log_fd >= 0 && close(fl->log_fd)) || (fl->dfd >= 0 && close(fl->dfd))){
             VERBOSE_PRINT(do_verbose, "File Close Error\n");
             return ret;
         }
@@ -294,7 +1600,11 @@ int gtfs_remove_file(gtfs_t* gtfs, file_t* fl) {
         // todo: remove file from disk, remove log file
 
         gtfs->fsq.erase(itr);
-        if(fclose(fl->log)){
+        if(fl->flags & GTFS_LOG_STRUCTURED) seg_close(fl);
+        if(fl->replayer.joinable()) fl->replayer.join();
+        free_writes(fl);
+        dio_tail_reset(&fl->log_tail);
+        if((fl->log_fd >= 0 && close(fl->log_fd)) || (fl->dfd >= 0 && close(fl->dfd))){
             VERBOSE_PRINT(do_verbose, "File Close Error\n");
             return ret;
         }
@@ -311,21 +1621,35 @@ int gtfs_remove_file(gtfs_t* gtfs, file_t* fl) {
 }
 
 char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length) {
-    char* ret_data = new char[length];
+    // one extra NUL so callers can treat text data as a C string
+    char* ret_data = new char[length + 1];
     int cur_pid = getpid();
     size_t pos;
     int pid;
-    memset(ret_data, 0, length);
+    memset(ret_data, 0, length + 1);
     if(!(gtfs and fl && fl->fp)) {
         VERBOSE_PRINT(do_verbose, "GTFileSystem or file or fp does not exist\n");
         return NULL;
     }
 
     VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
-    fseek(fl->fp, offset, SEEK_SET);
-    fread(ret_data, sizeof(char), length, fl->fp);
+    if (read_base(fl, offset, length, ret_data) < 0) {
+        VERBOSE_PRINT(do_verbose, "Read failed\n");
+        delete[] ret_data;
+        return NULL;
+    }
+    // committed data of a log-structured file, and log records a lazy open
+    // has not checkpointed yet, are found through the index
+    {
+        lock_guard<mutex> lk(fl->lock);
+        if (index_read(fl, offset, length, ret_data) < 0) {
+            delete[] ret_data;
+            return NULL;
+        }
+    }
     // read current writes in memory
     for (const auto& write: fl->writes) {
+        if ((fl->flags & GTFS_LOG_STRUCTURED) and write->com) continue;
         pos = write->id.find('_');
         pid = stoi(write->id.substr(0, pos));
         if(pid != cur_pid) {
@@ -336,7 +1660,10 @@ char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length) {
             int write_end = std::min(offset + length, write->offset + write->length);
             int write_length = write_end - write_start;
 
-            memcpy(ret_data + (write_start - offset), write->data + (write_start - write->offset), write_length);
+            if (load_payload(write, write_start - write->offset, write_length, ret_data + (write_start - offset)) < 0) {
+                delete[] ret_data;
+                return NULL;
+            }
         }
     }
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns pointer to data read.
@@ -358,9 +1685,14 @@ write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const
 
     VERBOSE_PRINT(do_verbose, "Writting " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
     
+    if (mem_reserve(gtfs, length) < 0) {
+        VERBOSE_PRINT(do_verbose, "Pending write memory exhausted\n");
+        return NULL;
+    }
     write_id = new (std::nothrow) write_t();
     if(!write_id){
         VERBOSE_PRINT(do_verbose, "Malloc Failed\n");
+        mem_release(gtfs, length);
         return NULL;
     }
 
@@ -372,6 +1704,8 @@ write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const
     write_id->filename = fl->filename;
     write_id->id = generate_unique_id();
     write_id->com = 0;
+    write_id->log_pos = -1;
+    write_id->delta = 0;
    // write_id->log = fl->log;
     
     // string logstr = "0" + to_string(length) + " " + to_string(offset) + " " + data;
@@ -393,7 +1727,7 @@ write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const
 int gtfs_sync_write_file(write_t* write_id) {
     int ret = -1;
 
-    if(!(write_id and write_id->filep and (write_id->filep)->log)) {
+    if(!(write_id and write_id->filep)) {
         VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
         return ret;
     }
@@ -412,17 +1746,24 @@ int gtfs_sync_write_file(write_t* write_id) {
         return ret;
     }
     */
-    // write log file
-    int log_result = fprintf((write_id->filep)->log, "write_id:%s\nfilename:%s\noffset:%d\nlength:%d\ndata:%.*s\n\n",
-                             write_id->id.c_str(), write_id->filename.c_str(), write_id->offset, write_id->length, write_id->length, write_id->data);
-    if (log_result < 0) {
+    // already in the log; its payload may have been spilled
+    if (write_id->com) return write_id->length;
+    int delta = 0;
+    if ((write_id->filep)->flags & GTFS_DELTA_LOG) {
+        delta = delta_append(write_id->filep, write_id);
+        if (delta < 0) {
+            VERBOSE_PRINT(do_verbose, "Write to log failed\n");
+            return ret;
+        }
+    }
+    // write log file, or the segment that replaces it
+    if (!delta && (((write_id->filep)->flags & GTFS_LOG_STRUCTURED) ?
+        seg_append(write_id->filep, write_id, write_id->length) < 0 :
+        log_append(write_id->filep, write_id, write_id->length) < 0)) {
         VERBOSE_PRINT(do_verbose, "Write to log failed\n");
         return ret;
     }
-    else{
-        ret = write_id->length;
-    }
-    fflush((write_id->filep)->log);
+    ret = write_id->length;
     write_id->com = 1;
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of bytes written.
     return ret;
@@ -446,7 +1787,8 @@ int gtfs_abort_write_file(write_t* write_id) {
             VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
             return ret;
         }
-        delete write_id->data;
+        if (write_id->data) mem_release(write_id->filep->gtfs, write_id->length);
+        delete[] write_id->data;
         delete write_id;
     } else {
         VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
@@ -481,21 +1823,77 @@ int gtfs_sync_write_file_n_bytes(write_t* write_id, int bytes){
         VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
         return ret;
     }
-    char *data = new char[write_id->length];
-    memcpy(data, write_id->data, bytes);
-    // write log file
-    int log_result = fprintf((write_id->filep)->log, "write_id: %s\nfilename: %s\noffset: %d\nlength: %d\ndata: %.*s\n\n",
-                             write_id->id.c_str(), write_id->filename.c_str(), write_id->offset, write_id->length, write_id->length, data);
-    if (log_result < 0) {
-        VERBOSE_PRINT(do_verbose, "Write to log failed\n");
+    if (!write_id->filep or bytes < 0 or bytes > write_id->length) {
+        VERBOSE_PRINT(do_verbose, "Invalid partial write\n");
         return ret;
     }
-    else{
-        ret = bytes;
+    // write only the first bytes of the record; a torn record is not committed
+    if (write_id->com) return bytes;
+    if (((write_id->filep)->flags & GTFS_LOG_STRUCTURED) ?
+        seg_append(write_id->filep, write_id, bytes) < 0 :
+        log_append(write_id->filep, write_id, bytes) < 0) {
+        VERBOSE_PRINT(do_verbose, "Write to log failed\n");
+        return ret;
     }
-    fflush((write_id->filep)->log);
-    write_id->com = 1;
+    ret = bytes;
+    if (bytes == write_id->length) write_id->com = 1;
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
     return ret;
 }
 
+
+// Fault injection
+
+const char* gtfs_crash_point_name(int point){
+    switch(point){
+        case CRASH_NONE: return "none";
+        case CRASH_MID_LOG_APPEND: return "mid_log_append";
+        case CRASH_AFTER_LOG_APPEND: return "after_log_append";
+        case CRASH_MID_APPLY: return "mid_apply";
+        case CRASH_BEFORE_LOG_TRUNCATE: return "before_log_truncate";
+        case CRASH_MID_COMPACT: return "mid_compact";
+        default: return "unknown";
+    }
+}
+
+void gtfs_set_crash_point(int point, int skip){
+    crash_point = point;
+    crash_skip = skip;
+}
+
+// Pending-write memory budget
+
+int gtfs_set_mem_budget(gtfs_t* gtfs, long bytes, int policy){
+    if (!gtfs or bytes < 0 or (policy != GTFS_MEM_SPILL and policy != GTFS_MEM_CHECKPOINT)) {
+        VERBOSE_PRINT(do_verbose, "Invalid memory budget\n");
+        return -1;
+    }
+    lock_guard<mutex> lk(gtfs->mem_lock);
+    gtfs->mem_budget = bytes;
+    gtfs->mem_policy = policy;
+    return 0;
+}
+
+long gtfs_mem_usage(gtfs_t* gtfs){
+    if (!gtfs) return -1;
+    lock_guard<mutex> lk(gtfs->mem_lock);
+    return gtfs->mem_used;
+}
+
+int gtfs_set_log_size(gtfs_t* gtfs, long bytes){
+    if (!gtfs or bytes <= 0) {
+        VERBOSE_PRINT(do_verbose, "Invalid log size\n");
+        return -1;
+    }
+    gtfs->log_size = bytes;
+    return 0;
+}
+
+int gtfs_set_flags(gtfs_t* gtfs, int flags){
+    if (!gtfs) {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return -1;
+    }
+    gtfs->flags = flags;
+    return 0;
+}
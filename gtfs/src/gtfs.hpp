@@ -10,6 +10,11 @@
 #include <vector>
 #include <algorithm>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
 
 using namespace std;
 
@@ -21,21 +26,90 @@ using namespace std;
 #define MAX_FILENAME_LEN 255
 #define MAX_NUM_FILES_PER_DIR 1024
 
+// gtfs_open_file flags
+#define GTFS_LOG_STRUCTURED 0x1   // keep committed data in append-only segments
+#define GTFS_DIRECT_IO 0x2        // bypass the page cache with O_DIRECT (also a gtfs_init flag)
+#define GTFS_DELTA_LOG 0x4        // log only the bytes a sync changes
+#define GTFS_LAZY_REPLAY 0x8      // open without applying the log; a background thread applies it
+
+// gtfs_set_mem_budget policies
+#define GTFS_MEM_SPILL 0          // drop committed payloads, read them back from the log
+#define GTFS_MEM_CHECKPOINT 1     // checkpoint committed writes out of memory
+
 extern int do_verbose;
 struct write;
+struct gtfs;
+
+// Location of a committed range inside a segment file
+typedef struct extent {
+    int length;
+    int seg;
+    long pos;
+} extent_t;
+
+// Last block an append-only direct I/O writer left partly filled, so the
+// next append does not read it back. Unset while block is NULL or off < 0.
+typedef struct dio_tail {
+    long off;
+    char* block;
+} dio_tail_t;
 
 typedef struct file {
     string filename;
     int file_length;
     vector<struct write*> writes;
     FILE* fp;
-    FILE* log;
+    int dfd;                // GTFS_DIRECT_IO: O_DIRECT descriptor of the data file
+    // circular log: records live in [log_start, log_end) of a preallocated
+    // ring of log_cap bytes
+    int log_fd;
+    uint64_t log_cap;
+    uint64_t log_start;
+    uint64_t log_end;
+    dio_tail_t log_tail;
+    struct gtfs* gtfs;
+    int flags;
+    // GTFS_LOG_STRUCTURED: logical offset -> segment location, and the
+    // open segment descriptors by sequence number. A lazy open indexes the
+    // extents of its log here too, until they are checkpointed
+    map<int, extent_t> index;
+    map<int, int> segs;
+    int active_seg;
+    uint64_t seg_end;       // append position of the active segment
+    dio_tail_t seg_tail;
+    int next_seg;
+    long live_bytes;
+    long seg_bytes;
+    // sequential readahead of the data file
+    long ra_next;           // offset a sequential reader asks for next
+    int ra_seq;             // consecutive sequential reads
+    int ra_window;          // size of the next readahead
+    vector<char> ra_buf;    // data file bytes [ra_off, ra_off + ra_len)
+    long ra_off;
+    int ra_len;
+    // guards index and segs against the background compactor
+    mutex lock;
+    condition_variable wake;
+    thread compactor;
+    int stop;
+    int compacting;         // a compaction is copying from a snapshot of index
+    // GTFS_LAZY_REPLAY: applies the extents indexed at open to the data file
+    thread replayer;
+    int replay_err;
+    uint64_t replay_end;    // end of the log records indexed at open
 } file_t;
 
 typedef struct gtfs {
     string dirname;
     // TODO: Add any additional fields if necessary
     vector<file_t*> fsq;
+    long log_size;          // ring size of newly created logs
+    int flags;              // gtfs_open_file flags applied to every file (gtfs_set_flags)
+    // payload bytes of the writes held in memory, and the budget for them
+    long mem_used;
+    long mem_budget;
+    int mem_policy;
+    mutex mem_lock;
 } gtfs_t;
 
 extern vector<gtfs_t *> efd;
@@ -53,14 +127,17 @@ typedef struct write {
     //FILE* log;
     file_t* filep;
     int com;
+    long log_pos;   // log position of the payload once the write is committed
+                    // (of the delta record, for a delta-logged write)
+    int delta;      // logged as a delta, so the log does not hold the payload
 } write_t;
 
 // GTFileSystem basic API calls
 
-gtfs_t* gtfs_init(string directory, int verbose_flag);
+gtfs_t* gtfs_init(string directory, int verbose_flag, int flags = 0);
 int gtfs_clean(gtfs_t *gtfs);
 
-file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length);
+file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length, int flags = 0);
 int gtfs_close_file(gtfs_t* gtfs, file_t* fl);
 int gtfs_remove_file(gtfs_t* gtfs, file_t* fl);
 
@@ -76,5 +153,35 @@ int gtfs_sync_write_file_n_bytes(write_t* write_id, int bytes);
 
 // TODO: Add here any additional data structures or API calls
 
+// Bound the payload memory of pending writes to `bytes` (0 = unlimited).
+// Over budget, committed payloads are reclaimed according to policy; a
+// write that still does not fit gets NULL from gtfs_write_file, and the
+// caller should sync or abort pending writes before retrying.
+int gtfs_set_mem_budget(gtfs_t* gtfs, long bytes, int policy);
+long gtfs_mem_usage(gtfs_t* gtfs);
+
+// Size of the preallocated ring of logs created from now on. A log that
+// cannot fit a record even after a checkpoint grows.
+int gtfs_set_log_size(gtfs_t* gtfs, long bytes);
+
+// Open flags applied to every file opened in the directory from now on.
+// gtfs_init only sets them when it creates the directory's gtfs_t.
+int gtfs_set_flags(gtfs_t* gtfs, int flags);
+
+// Crash-point fault injection, used by tests/crash_test.cpp
+enum gtfs_crash_point {
+    CRASH_NONE = 0,
+    CRASH_MID_LOG_APPEND,       // part of a log record has reached the log
+    CRASH_AFTER_LOG_APPEND,     // log record written but not synced
+    CRASH_MID_APPLY,            // trct_mem_log applied some writes to the data file
+    CRASH_BEFORE_LOG_TRUNCATE,  // data file flushed, log not yet truncated
+    CRASH_MID_COMPACT,          // compacted segment written, old segments not yet removed
+    CRASH_NUM_POINTS
+};
+
+// Abort the process on the (skip + 1)-th time `point` is reached.
+void gtfs_set_crash_point(int point, int skip);
+const char* gtfs_crash_point_name(int point);
+
 
 #endif
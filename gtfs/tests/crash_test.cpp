@@ -0,0 +1,252 @@
+#include "test_files.hpp"
+#include <chrono>
+#include <random>
+#include <set>
+#include <cstring>
+#include <sys/stat.h>
+
+// Crash-point torture test: a forked child runs a random workload and is
+// killed at one of the library's injection points, then the parent recovers
+// the file and checks it against a reference model of the committed writes.
+
+#define FILE_LEN 65536
+#define MAX_WRITE_LEN 512
+
+string directory;
+int verbose;
+int rounds = 1;
+
+enum op_kind { OP_SYNC, OP_ABORT, OP_PENDING };
+
+typedef struct op {
+    int kind;
+    int offset;
+    int length;
+    string data;
+} op_t;
+
+// Both the child and the reference model draw the workload from here, so the
+// same seed always yields the same sequence of writes.
+op_t next_op(mt19937& rng) {
+    op_t op;
+    int r = rng() % 16;
+    op.kind = r == 0 ? OP_PENDING : (r < 3 ? OP_ABORT : OP_SYNC);
+    op.length = 1 + rng() % MAX_WRITE_LEN;
+    op.offset = rng() % (FILE_LEN - op.length);
+    op.data.resize(op.length);
+    // mostly a fixed pattern of the file position with a few changed bytes,
+    // so that rewrites look like record updates to delta logging
+    for (int i = 0; i < op.length; i++) {
+        int pos = op.offset + i;
+        op.data[i] = (rng() % 64 == 0) ? (char)(rng() & 0xff) : (char)(pos * 131 + (pos >> 8));
+    }
+    return op;
+}
+
+// Contents of the file after the synced writes whose operation indexes are
+// in ops, up to and including operation last.
+string model(unsigned seed, const set<int>& ops, int last) {
+    mt19937 rng(seed);
+    string contents(FILE_LEN, '\0');
+    for (int i = 0; i <= last; i++) {
+        op_t op = next_op(rng);
+        if (ops.count(i)) contents.replace(op.offset, op.length, op.data);
+    }
+    return contents;
+}
+
+// Index of the first sync operation after operation i, or -1.
+int next_sync(unsigned seed, int i, int nwrites) {
+    mt19937 rng(seed);
+    for (int j = 0; j < nwrites; j++) {
+        if (next_op(rng).kind == OP_SYNC && j > i) return j;
+    }
+    return -1;
+}
+
+// Runs nwrites operations, reporting each sync that returned through fd,
+// then checkpoints the file with gtfs_clean. Log-structured files are
+// reopened every few operations; each open starts a segment, so the
+// segment count forces compactions even for small workloads.
+void workload(string filename, int flags, unsigned seed, int nwrites, int fd) {
+    mt19937 rng(seed);
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    // a ring about the size of the workload, so the log grows with nwrites
+    gtfs_set_log_size(gtfs, (long)nwrites * MAX_WRITE_LEN);
+    file_t *fl = gtfs_open_file(gtfs, filename, FILE_LEN, flags);
+
+    for (int i = 0; i < nwrites; i++) {
+        if ((flags & GTFS_LOG_STRUCTURED) && i > 0 && i % (nwrites / 16 + 1) == 0) {
+            gtfs_close_file(gtfs, fl);
+            fl = gtfs_open_file(gtfs, filename, FILE_LEN, flags);
+        }
+        op_t op = next_op(rng);
+        write_t *wrt = gtfs_write_file(gtfs, fl, op.offset, op.length, op.data.c_str());
+        if (op.kind == OP_ABORT) {
+            gtfs_abort_write_file(wrt);
+        } else if (op.kind == OP_SYNC) {
+            // only a sync that returned counts as committed
+            if (gtfs_sync_write_file(wrt) >= 0 && write(fd, &i, sizeof(i)) != sizeof(i)) _exit(2);
+        }
+    }
+    gtfs_clean(gtfs);
+    gtfs_close_file(gtfs, fl);
+}
+
+long file_size(string path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+// Bytes of log a recovery has to go through: the .log plus any segments.
+long log_size(string filename) {
+    long bytes = max(file_size(filename + ".log"), 0L);
+    for (const auto& name: segment_files(filename)) bytes += file_size(name);
+    return bytes;
+}
+
+string read_raw(string path) {
+    ifstream in(path, ios::binary);
+    string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    contents.resize(FILE_LEN, '\0');
+    return contents;
+}
+
+// Number of synced writes among the first nwrites operations.
+int count_synced(unsigned seed, int nwrites) {
+    mt19937 rng(seed);
+    int synced = 0;
+    for (int i = 0; i < nwrites; i++) {
+        if (next_op(rng).kind == OP_SYNC) synced++;
+    }
+    return synced;
+}
+
+int run_scenario(int point, int flags, int nwrites, unsigned seed) {
+    string filename = "crash.txt";
+    int fds[2];
+    int pid, status, committed = 0, idx, last = -1;
+    set<int> ops;
+    int synced = count_synced(seed, nwrites);
+    int skip;
+
+    remove_files(filename);
+
+    // crash late in the run so the log holds most of the workload
+    mt19937 pick(seed ^ 0x9e3779b9);
+    // direct I/O applies a checkpoint in a few runs of blocks, so crash on the first
+    if (point == CRASH_MID_APPLY && (flags & GTFS_DIRECT_IO)) skip = 0;
+    else if (point == CRASH_MID_APPLY) skip = pick() % synced;
+    else if (point == CRASH_BEFORE_LOG_TRUNCATE || point == CRASH_MID_COMPACT) skip = 0;
+    else skip = synced / 2 + pick() % (synced - synced / 2);
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(-1);
+    }
+    cout.flush();
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        gtfs_set_crash_point(point, skip);
+        workload(filename, flags, seed, nwrites, fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    while (read(fds[0], &idx, sizeof(idx)) == sizeof(idx)) {
+        ops.insert(idx);
+        last = idx;
+        committed++;
+    }
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    cout << "  " << gtfs_crash_point_name(point) << ((flags & GTFS_LOG_STRUCTURED) ? " (log-structured)" : "") << ((flags & GTFS_DIRECT_IO) ? " (direct)" : "") << ((flags & GTFS_DELTA_LOG) ? " (delta)" : "") << ((flags & GTFS_LAZY_REPLAY) ? " (lazy)" : "") << " writes=" << nwrites << " seed=" << seed << ": ";
+    if (!(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT)) {
+        cout << "crash point not reached" << FAIL;
+        return -1;
+    }
+    long log_bytes = log_size(filename);
+
+    // recovery happens inside gtfs_open_file; a lazy open leaves applying
+    // the log to a background thread, so the read below races with it
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    auto start = chrono::steady_clock::now();
+    file_t *fl = gtfs_open_file(gtfs, filename, FILE_LEN, flags);
+    auto end = chrono::steady_clock::now();
+    if (fl == NULL) {
+        cout << "open failed" << FAIL;
+        return -1;
+    }
+    char *data = gtfs_read_file(gtfs, fl, 0, FILE_LEN);
+    string recovered(data, FILE_LEN);
+    delete[] data;
+    gtfs_close_file(gtfs, fl);
+    string raw = read_raw(filename);
+
+    // the write in flight at the crash may or may not have made it
+    string before = model(seed, ops, last);
+    string after = before;
+    int inflight = next_sync(seed, last, nwrites);
+    if (inflight >= 0) {
+        ops.insert(inflight);
+        after = model(seed, ops, inflight);
+    }
+    int ok = recovered == before || recovered == after;
+    // in-place recovery checkpoints everything into the data file
+    if (!(flags & GTFS_LOG_STRUCTURED)) ok = ok && raw == recovered;
+
+    double ms = chrono::duration<double, milli>(end - start).count();
+    cout << "committed=" << committed << " log=" << log_bytes / 1024 << "KB recovery=" << ms << "ms";
+    cout << (ok ? PASS : FAIL);
+    return ok ? 0 : -1;
+}
+
+// Runs every crash point of points with the given open flags and returns
+// the number of failed scenarios.
+int run_points(vector<int> points, int flags, string label) {
+    int sizes[] = {64, 1024, 8192};
+    int failed = 0;
+    for (int point: points) {
+        cout << "================== Crash at " << gtfs_crash_point_name(point) << label << " ==================\n";
+        for (int nwrites: sizes) {
+            for (int r = 0; r < rounds; r++) {
+                if (run_scenario(point, flags, nwrites, 1000 * point + 10 * r + nwrites) < 0) failed++;
+            }
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2)
+        printf("Usage: ./crash_test verbose_flag [rounds]\n");
+    else
+        verbose = strtol(argv[1], NULL, 10);
+    if (argc > 2)
+        rounds = strtol(argv[2], NULL, 10);
+
+    char cwd[256];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        directory = string(cwd);
+    } else {
+        cout << "[cwd] Something went wrong.\n";
+    }
+
+    vector<int> in_place = {CRASH_MID_LOG_APPEND, CRASH_AFTER_LOG_APPEND, CRASH_MID_APPLY, CRASH_BEFORE_LOG_TRUNCATE};
+    vector<int> log_structured = {CRASH_MID_LOG_APPEND, CRASH_AFTER_LOG_APPEND, CRASH_MID_COMPACT};
+    int failed = 0;
+    failed += run_points(in_place, 0, "");
+    failed += run_points(log_structured, GTFS_LOG_STRUCTURED, " (log-structured)");
+    failed += run_points(in_place, GTFS_DIRECT_IO, " (direct I/O)");
+    failed += run_points(in_place, GTFS_DELTA_LOG, " (delta)");
+    failed += run_points({CRASH_MID_LOG_APPEND, CRASH_AFTER_LOG_APPEND}, GTFS_LOG_STRUCTURED | GTFS_DELTA_LOG, " (log-structured, delta)");
+    failed += run_points(in_place, GTFS_LAZY_REPLAY, " (lazy replay)");
+    failed += run_points(in_place, GTFS_LAZY_REPLAY | GTFS_DELTA_LOG | GTFS_DIRECT_IO, " (lazy replay, delta, direct I/O)");
+    remove_files("crash.txt");
+    return failed ? 1 : 0;
+}
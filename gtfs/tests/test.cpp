@@ -1,4 +1,5 @@
-#include "../src/gtfs.hpp"
+#include "test_files.hpp"
+#include <sys/stat.h>
 
 // Assumes files are located within the current directory
 string directory;
@@ -216,6 +217,343 @@ void test_write_read_non() {
     reader_non();
 }
 
+// **Test 7**: Testing that a log-structured file keeps its data across close and reopen.
+
+void test_log_structured() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test7.txt";
+    remove_files(filename);
+    file_t *fl = gtfs_open_file(gtfs, filename, 100, GTFS_LOG_STRUCTURED);
+
+    string str = "Testing string.\n";
+    write_t *wrt1 = gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
+    gtfs_sync_write_file(wrt1);
+    write_t *wrt2 = gtfs_write_file(gtfs, fl, 8, str.length(), str.c_str());
+    gtfs_sync_write_file(wrt2);
+    gtfs_close_file(gtfs, fl);
+
+    // reopened without the flag, the file stays log-structured, and being
+    // reopened over and over does not pile up segments
+    string expected = str.substr(0, 8) + str;
+    int ok = 1, cycles = 16;
+    for (int i = 0; i < cycles; i++) {
+        fl = gtfs_open_file(gtfs, filename, 100);
+        char *data = gtfs_read_file(gtfs, fl, 0, expected.length());
+        if (data == NULL || expected.compare(string(data, expected.length())) != 0) ok = 0;
+        delete[] data;
+        write_t *wrt = gtfs_write_file(gtfs, fl, 0, 8, str.c_str());
+        gtfs_sync_write_file(wrt);
+        gtfs_close_file(gtfs, fl);
+    }
+    if (segment_files(filename).size() >= (size_t)cycles) ok = 0;
+    ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 8**: Testing that pending writes stay within the memory budget.
+
+void test_mem_budget() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test8.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    int ok = 1;
+
+    long base = gtfs_mem_usage(gtfs);
+    gtfs_set_mem_budget(gtfs, base + 64, GTFS_MEM_SPILL);
+    string str = "Testing string.\n";
+    // synced writes are spilled to the log and still readable
+    for (int i = 0; i < 5; i++) {
+        write_t *wrt = gtfs_write_file(gtfs, fl, i * 16, str.length(), str.c_str());
+        if (wrt == NULL || gtfs_sync_write_file(wrt) < 0) ok = 0;
+    }
+    if (gtfs_mem_usage(gtfs) > base + 64) ok = 0;
+    char *data = gtfs_read_file(gtfs, fl, 0, str.length());
+    if (data == NULL || str.compare(string(data, str.length())) != 0) ok = 0;
+
+    // unsynced writes cannot be spilled, so the writer is pushed back
+    vector<write_t *> pending;
+    write_t *wrt;
+    while ((wrt = gtfs_write_file(gtfs, fl, 80, str.length(), str.c_str())) != NULL && pending.size() < 8) {
+        pending.push_back(wrt);
+    }
+    if (wrt != NULL || pending.size() != 4) ok = 0;
+    for (const auto &w: pending) gtfs_abort_write_file(w);
+    if (gtfs_mem_usage(gtfs) != base) ok = 0;
+
+    gtfs_set_mem_budget(gtfs, 0, GTFS_MEM_SPILL);
+    gtfs_close_file(gtfs, fl);
+
+    // delta-logged writes cannot be spilled, so they are checkpointed instead
+    fl = gtfs_open_file(gtfs, filename, 100, GTFS_DELTA_LOG);
+    gtfs_set_mem_budget(gtfs, base + 64, GTFS_MEM_SPILL);
+    for (int i = 0; i < 5; i++) {
+        wrt = gtfs_write_file(gtfs, fl, i * 16, str.length(), str.c_str());
+        if (wrt == NULL || gtfs_sync_write_file(wrt) < 0) ok = 0;
+    }
+    if (gtfs_mem_usage(gtfs) > base + 64) ok = 0;
+    gtfs_set_mem_budget(gtfs, 0, GTFS_MEM_SPILL);
+    gtfs_close_file(gtfs, fl);
+
+    // removing a file gives back the memory of its pending writes
+    fl = gtfs_open_file(gtfs, filename, 100);
+    gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
+    gtfs_remove_file(gtfs, fl);
+    if (gtfs_mem_usage(gtfs) != base) ok = 0;
+    ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 9**: Testing that a sequential scan sees checkpointed data and pending writes.
+
+void test_sequential_read() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test9.txt";
+    int len = 256 * 1024, chunk = 4096;
+    file_t *fl = gtfs_open_file(gtfs, filename, len);
+    string expected(len, '\0');
+    int ok = 1;
+
+    for (int i = 0; i < len; i++) expected[i] = 'a' + i % 26;
+    write_t *wrt = gtfs_write_file(gtfs, fl, 0, len, expected.c_str());
+    gtfs_sync_write_file(wrt);
+    gtfs_clean(gtfs);
+
+    // a pending write in the middle of the scan must show through
+    string str = "Testing string.\n";
+    gtfs_write_file(gtfs, fl, 100000, str.length(), str.c_str());
+    expected.replace(100000, str.length(), str);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int off = 0; off < len; off += chunk) {
+            char *data = gtfs_read_file(gtfs, fl, off, chunk);
+            if (data == NULL || expected.compare(off, chunk, string(data, chunk)) != 0) ok = 0;
+            delete[] data;
+            // checkpoint new data halfway through the second scan
+            if (pass == 1 && off == len / 2) {
+                wrt = gtfs_write_file(gtfs, fl, len - chunk, str.length(), str.c_str());
+                gtfs_sync_write_file(wrt);
+                gtfs_clean(gtfs);
+                expected.replace(len - chunk, str.length(), str);
+            }
+        }
+    }
+    // reads as large as the readahead window bypass its buffer
+    for (int off = 0; off < len; off += len / 4) {
+        char *data = gtfs_read_file(gtfs, fl, off, len / 4);
+        if (data == NULL || expected.compare(off, len / 4, string(data, len / 4)) != 0) ok = 0;
+        delete[] data;
+    }
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// **Test 10**: Testing that a small log wraps, checkpoints and grows as needed.
+
+// Runs child in a forked process that then crashes.
+void crash_child(void (*child)(string), string filename) {
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        child(filename);
+        abort();
+    }
+    waitpid(pid, NULL, 0);
+}
+
+// Synced writes that are aborted keep their records in the log, so the
+// next write that fills the ring must still checkpoint before reusing it.
+void aborted_syncs(string filename) {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 20000);
+    string str(1000, 'a');
+    for (int i = 0; i < 3; i++) {
+        write_t *wrt = gtfs_write_file(gtfs, fl, i * 1000, str.length(), str.c_str());
+        gtfs_sync_write_file(wrt);
+        gtfs_abort_write_file(wrt);
+    }
+    str = string(1500, 'b');
+    write_t *wrt = gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
+    gtfs_sync_write_file(wrt);
+}
+
+void test_log_wrap() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_set_log_size(gtfs, 4096);
+    string filename = "test10.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 20000);
+    string expected(20000, '\0');
+    int ok = 1;
+
+    // each write fills most of the ring, the last one does not fit at all;
+    // the .log stays its 4 KB header plus the ring until then
+    int lengths[] = {3000, 3000, 3000, 10000};
+    long ring_size = 4096 + 4096;
+    struct stat st;
+    for (int i = 0; i < 4; i++) {
+        string str(lengths[i], 'a' + i);
+        write_t *wrt = gtfs_write_file(gtfs, fl, i * 2000, str.length(), str.c_str());
+        if (wrt == NULL || gtfs_sync_write_file(wrt) < 0) ok = 0;
+        expected.replace(i * 2000, str.length(), str);
+        if (stat((filename + ".log").c_str(), &st) < 0) ok = 0;
+        else if (i < 3 ? st.st_size != ring_size : st.st_size <= ring_size) ok = 0;
+    }
+    ring_size = st.st_size;
+    gtfs_clean(gtfs);
+    if (stat((filename + ".log").c_str(), &st) < 0 || st.st_size != ring_size) ok = 0;
+    char *data = gtfs_read_file(gtfs, fl, 0, expected.length());
+    if (data == NULL || expected.compare(string(data, expected.length())) != 0) ok = 0;
+    delete[] data;
+    gtfs_close_file(gtfs, fl);
+
+    remove_files(filename);
+    crash_child(aborted_syncs, filename);
+    fl = gtfs_open_file(gtfs, filename, 20000);
+    expected = string(1500, 'b');
+    data = gtfs_read_file(gtfs, fl, 0, expected.length());
+    if (data == NULL || expected.compare(string(data, expected.length())) != 0) ok = 0;
+    delete[] data;
+    gtfs_close_file(gtfs, fl);
+
+    gtfs_set_log_size(gtfs, 1024 * 1024);
+    ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 11**: Testing that unaligned writes in direct I/O mode land exactly in the file.
+
+void test_direct_io() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_set_flags(gtfs, GTFS_DIRECT_IO);
+    string filename = "test11.txt";
+    remove(filename.c_str());
+    file_t *fl = gtfs_open_file(gtfs, filename, 20000);
+    string expected(10007, '\0');
+    int ok = 1;
+
+    // straddle block boundaries and leave the file a non-block length
+    int offsets[] = {100, 4000, 8190, 9000};
+    int lengths[] = {50, 300, 10, 1007};
+    for (int i = 0; i < 4; i++) {
+        string str(lengths[i], 'a' + i);
+        write_t *wrt = gtfs_write_file(gtfs, fl, offsets[i], str.length(), str.c_str());
+        if (wrt == NULL || gtfs_sync_write_file(wrt) < 0) ok = 0;
+        expected.replace(offsets[i], str.length(), str);
+    }
+    gtfs_clean(gtfs);
+    char *data = gtfs_read_file(gtfs, fl, 0, expected.length());
+    if (data == NULL || expected.compare(string(data, expected.length())) != 0) ok = 0;
+    delete[] data;
+    gtfs_close_file(gtfs, fl);
+    gtfs_set_flags(gtfs, 0);
+
+    ifstream in(filename, ios::binary);
+    string raw((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if (raw != expected) ok = 0;
+    ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 12**: Testing that field updates logged as deltas are replayed after a crash.
+
+string delta_record(int version) {
+    string record(4096, '.');
+    // a few small fields change with every version
+    for (int field = 0; field < 4; field++) {
+        string value = "field" + to_string(field) + "=v" + to_string(version);
+        record.replace(field * 1000 + 17, value.length(), value);
+    }
+    return record;
+}
+
+// Runs child in a forked process that crashes when it returns.
+void delta_versions(string filename) {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 4096, GTFS_DELTA_LOG);
+    for (int version = 0; version < 4; version++) {
+        string record = delta_record(version);
+        write_t *wrt = gtfs_write_file(gtfs, fl, 0, record.length(), record.c_str());
+        gtfs_sync_write_file(wrt);
+        if (version == 0) gtfs_clean(gtfs);
+    }
+}
+
+// Two writes committed in the opposite order they were made in, then a
+// third that matches the older one; recovery replays them in commit order.
+void delta_commit_order(string filename) {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 4096, GTFS_DELTA_LOG);
+    string a(64, 'A'), b(64, 'B');
+    write_t *wrt_a = gtfs_write_file(gtfs, fl, 0, a.length(), a.c_str());
+    write_t *wrt_b = gtfs_write_file(gtfs, fl, 0, b.length(), b.c_str());
+    gtfs_sync_write_file(wrt_b);
+    gtfs_sync_write_file(wrt_a);
+    write_t *wrt_c = gtfs_write_file(gtfs, fl, 0, b.length(), b.c_str());
+    gtfs_sync_write_file(wrt_c);
+}
+
+void test_delta_log() {
+    string filename = "test12.txt";
+    remove(filename.c_str());
+    remove((filename + ".log").c_str());
+    int ok = 1;
+
+    crash_child(delta_versions, filename);
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 4096, GTFS_DELTA_LOG);
+    string expected = delta_record(3);
+    char *data = gtfs_read_file(gtfs, fl, 0, expected.length());
+    if (data == NULL || expected.compare(string(data, expected.length())) != 0) ok = 0;
+    delete[] data;
+    gtfs_close_file(gtfs, fl);
+
+    crash_child(delta_commit_order, filename);
+    fl = gtfs_open_file(gtfs, filename, 4096, GTFS_DELTA_LOG);
+    expected = string(64, 'B');
+    data = gtfs_read_file(gtfs, fl, 0, expected.length());
+    if (data == NULL || expected.compare(string(data, expected.length())) != 0) ok = 0;
+    delete[] data;
+    gtfs_close_file(gtfs, fl);
+    ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 13**: Testing that a lazy open serves reads from the log while it is replayed.
+
+void test_lazy_replay() {
+    string filename = "test13.txt";
+    int len = 256 * 1024, chunk = 1024;
+    remove(filename.c_str());
+    remove((filename + ".log").c_str());
+    string expected(len, '\0');
+    for (int off = 0; off < len; off += chunk) expected.replace(off, chunk, string(chunk, 'a' + off / chunk % 26));
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        gtfs_set_log_size(gtfs, 2 * len);
+        file_t *fl = gtfs_open_file(gtfs, filename, len);
+        for (int off = 0; off < len; off += chunk) {
+            write_t *wrt = gtfs_write_file(gtfs, fl, off, chunk, expected.c_str() + off);
+            gtfs_sync_write_file(wrt);
+        }
+        abort();
+    }
+    waitpid(pid, NULL, 0);
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, len, GTFS_LAZY_REPLAY);
+    char *data = gtfs_read_file(gtfs, fl, 0, len);
+    int ok = data != NULL && expected.compare(string(data, len)) == 0;
+    delete[] data;
+    gtfs_close_file(gtfs, fl);
+
+    ifstream in(filename, ios::binary);
+    string raw((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if (raw != expected) ok = 0;
+    ok ? cout << PASS : cout << FAIL;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2)
         printf("Usage: ./test verbose_flag\n");
@@ -255,4 +593,32 @@ int main(int argc, char **argv) {
     cout << "================== Test 6 ==================\n";
     cout << "Testing if non-synced write in one process will not read in the other.\n";
     test_write_read_non();
+
+    cout << "================== Test 7 ==================\n";
+    cout << "Testing that a log-structured file keeps its data across close and reopen.\n";
+    test_log_structured();
+
+    cout << "================== Test 8 ==================\n";
+    cout << "Testing that pending writes stay within the memory budget.\n";
+    test_mem_budget();
+
+    cout << "================== Test 9 ==================\n";
+    cout << "Testing that a sequential scan sees checkpointed data and pending writes.\n";
+    test_sequential_read();
+
+    cout << "================== Test 10 ==================\n";
+    cout << "Testing that a small log wraps, checkpoints and grows as needed.\n";
+    test_log_wrap();
+
+    cout << "================== Test 11 ==================\n";
+    cout << "Testing that unaligned writes in direct I/O mode land exactly in the file.\n";
+    test_direct_io();
+
+    cout << "================== Test 12 ==================\n";
+    cout << "Testing that field updates logged as deltas are replayed after a crash.\n";
+    test_delta_log();
+
+    cout << "================== Test 13 ==================\n";
+    cout << "Testing that a lazy open serves reads from the log while it is replayed.\n";
+    test_lazy_replay();
 }
@@ -0,0 +1,30 @@
+#ifndef GTFS_TEST_FILES
+#define GTFS_TEST_FILES
+
+#include "../src/gtfs.hpp"
+#include <dirent.h>
+
+// Helpers for the files a test leaves in the current directory, shared by
+// test.cpp and crash_test.cpp.
+
+// Names of the segment files of filename in the current directory.
+inline vector<string> segment_files(string filename) {
+    vector<string> names;
+    string prefix = filename + ".seg.";
+    DIR *d = opendir(".");
+    if (!d) return names;
+    while (struct dirent *ent = readdir(d)) {
+        if (string(ent->d_name).compare(0, prefix.length(), prefix) == 0) names.push_back(ent->d_name);
+    }
+    closedir(d);
+    return names;
+}
+
+// Removes filename together with its log and segments.
+inline void remove_files(string filename) {
+    remove(filename.c_str());
+    remove((filename + ".log").c_str());
+    for (const auto& name: segment_files(filename)) remove(name.c_str());
+}
+
+#endif